@@ -0,0 +1,201 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "bin_trace.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "common.h"
+
+/* sleep between drains when all rings are empty */
+#define TRACE_WRITER_SLEEP 1000 /* micros */
+
+namespace {
+struct trace_ring {
+  trace_rec_t* recs;
+  uint64_t cap; /* power of 2 */
+  /* head is only written by the owner and tail by the writer */
+  volatile uint64_t head;
+  char pad[64];
+  volatile uint64_t tail;
+  unsigned long long drops;
+  uint16_t tid;
+};
+
+struct trace_state {
+  FILE* file;
+  uint64_t t0;
+  uint64_t ring_sz;
+  pthread_mutex_t mtx; /* protects rings */
+  std::vector<trace_ring*> rings;
+  pthread_t writer;
+  volatile int shutdown;
+};
+
+trace_state* state = NULL;
+__thread trace_ring* my_ring = NULL;
+
+trace_ring* new_ring(trace_state* s) {
+  trace_ring* r = new trace_ring;
+  memset(r, 0, sizeof(*r));
+  r->cap = s->ring_sz;
+  r->recs = static_cast<trace_rec_t*>(malloc(r->cap * sizeof(trace_rec_t)));
+  if (r->recs == NULL) ABORT("malloc");
+  pthread_mtx_lock(&s->mtx);
+  r->tid = static_cast<uint16_t>(s->rings.size());
+  s->rings.push_back(r);
+  pthread_mtx_unlock(&s->mtx);
+  return r;
+}
+
+/* write out all published records of a ring. return num of records */
+uint64_t drain(trace_ring* r) {
+  const uint64_t head = r->head;
+  const uint64_t tail = r->tail;
+  if (head == tail) return 0;
+  __sync_synchronize(); /* read records after seeing them published */
+  const uint64_t b = tail & (r->cap - 1);
+  const uint64_t e = head & (r->cap - 1);
+  if (b < e) {
+    fwrite(r->recs + b, sizeof(trace_rec_t), e - b, state->file);
+  } else {
+    fwrite(r->recs + b, sizeof(trace_rec_t), r->cap - b, state->file);
+    fwrite(r->recs, sizeof(trace_rec_t), e, state->file);
+  }
+  __sync_synchronize(); /* finish with the records before releasing them */
+  r->tail = head;
+  return head - tail;
+}
+
+uint64_t drain_all() {
+  uint64_t n = 0;
+  pthread_mtx_lock(&state->mtx);
+  for (size_t i = 0; i < state->rings.size(); i++) {
+    n += drain(state->rings[i]);
+  }
+  pthread_mtx_unlock(&state->mtx);
+  return n;
+}
+
+void* writer_main(void* arg) {
+  while (!state->shutdown) {
+    if (drain_all() == 0) {
+      usleep(TRACE_WRITER_SLEEP);
+    }
+  }
+  return NULL;
+}
+}  // namespace
+
+void bin_trace_open(const char* path, int rank, uint64_t ring_sz) {
+  trace_hdr_t hdr;
+  assert(state == NULL);
+  state = new trace_state;
+  state->file = fopen(path, "w");
+  if (state->file == NULL) {
+    ABORT("!fopen");
+  }
+  state->ring_sz = 1;
+  while (state->ring_sz < ring_sz) state->ring_sz <<= 1;
+  state->t0 = now_micros();
+  state->shutdown = 0;
+  pthread_mutex_init(&state->mtx, NULL);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, TRACE_MAGIC, 8);
+  hdr.rank = static_cast<uint32_t>(rank);
+  hdr.rec_sz = sizeof(trace_rec_t);
+  hdr.t0 = state->t0;
+  fwrite(&hdr, sizeof(hdr), 1, state->file);
+
+  int rv = pthread_create(&state->writer, NULL, writer_main, NULL);
+  if (rv) ABORT("pthread_create");
+}
+
+void bin_trace_event(int type, int src, int dst, int epoch, uint32_t hash,
+                     uint32_t size) {
+  trace_state* const s = state;
+  if (s == NULL) return;
+  trace_ring* r = my_ring;
+  if (r == NULL) {
+    r = my_ring = new_ring(s);
+  }
+  const uint64_t head = r->head;
+  if (head - r->tail >= r->cap) {
+    r->drops++;
+    return;
+  }
+  trace_rec_t* const rec = &r->recs[head & (r->cap - 1)];
+  rec->micros = now_micros() - s->t0;
+  rec->src = src;
+  rec->dst = dst;
+  rec->epoch = epoch;
+  rec->hash = hash;
+  rec->size = size;
+  rec->type = static_cast<uint16_t>(type);
+  rec->tid = r->tid;
+  __sync_synchronize(); /* publish the record before the new head */
+  r->head = head + 1;
+}
+
+unsigned long long bin_trace_close() {
+  unsigned long long drops = 0;
+  trace_rec_t rec;
+  if (state == NULL) return 0;
+  state->shutdown = 1;
+  pthread_join(state->writer, NULL);
+  drain_all();
+
+  memset(&rec, 0, sizeof(rec));
+  rec.micros = now_micros() - state->t0;
+  rec.type = TRACE_DROPS;
+  for (size_t i = 0; i < state->rings.size(); i++) {
+    trace_ring* const r = state->rings[i];
+    if (r->drops != 0) {
+      rec.tid = r->tid;
+      rec.size = static_cast<uint32_t>(r->drops);
+      fwrite(&rec, sizeof(rec), 1, state->file);
+      drops += r->drops;
+    }
+  }
+  fclose(state->file);
+  state->file = NULL;
+
+  /* events traced after this point are ignored. rings are not freed since
+   * other threads may still be holding them */
+  state = NULL;
+  return drops;
+}
@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * bin_trace.h  binary event traces for testing mode.
+ *
+ * with PRELOAD_Trace_binary, per-particle and per-rpc trace events are not
+ * printed as text. instead, each thread appends fixed-size records to a
+ * ring of its own, without locks, and a background thread drains all rings
+ * into a per-rank binary file. when a ring is full, new events are dropped
+ * and counted. the number of dropped events is written to the file as a
+ * TRACE_DROPS record when the ring is closed.
+ *
+ * file format: a trace_hdr followed by trace_recs. records from different
+ * threads are interleaved in the order they were drained, so readers
+ * should sort records by time (see tools/preload_trace_decoder.cc).
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/* event types */
+#define TRACE_SH 1           /* particle shuffled out (size, src, dst, hash) */
+#define TRACE_LO 2           /* particle delivered locally (size, hash) */
+#define TRACE_RM 3           /* particle received (size, src, dst, hash) */
+#define TRACE_SEND 4         /* rpc sent (size, src, dst) */
+#define TRACE_RECV 5         /* rpc received (size, src, dst) */
+#define TRACE_DELIV_WAIT 6   /* waited for delivery (micros in size) */
+#define TRACE_SEND_SLOT 7    /* waited for an rpc slot (micros in size) */
+#define TRACE_REPLY_WAIT 8   /* waited for rpc replies (micros in size) */
+#define TRACE_ENQUEUE_WAIT 9 /* waited for an rpc queue (micros in size) */
+#define TRACE_DROPS 10       /* num of events dropped by a thread (in size) */
+
+#define TRACE_MAGIC "VPICTRC1"
+
+typedef struct trace_hdr {
+  char magic[8];    /* TRACE_MAGIC */
+  uint32_t rank;    /* MPI rank */
+  uint32_t rec_sz;  /* sizeof(trace_rec_t) */
+  uint64_t t0;      /* time (micros) records are relative to */
+} trace_hdr_t;
+
+typedef struct trace_rec {
+  uint64_t micros; /* time since t0 */
+  int32_t src;
+  int32_t dst;
+  int32_t epoch;
+  uint32_t hash; /* xxhash32 of the particle */
+  uint32_t size;
+  uint16_t type; /* TRACE_XXX */
+  uint16_t tid;  /* thread that produced the event */
+} trace_rec_t;
+
+/* start tracing into the given file with rings of ring_sz records.
+ * abort on errors */
+extern void bin_trace_open(const char* path, int rank, uint64_t ring_sz);
+
+/* add an event to the calling thread's ring */
+extern void bin_trace_event(int type, int src, int dst, int epoch,
+                            uint32_t hash, uint32_t size);
+
+/* drain all rings, stop the background writer, and close the file. return
+ * the total num of dropped events */
+extern unsigned long long bin_trace_close();
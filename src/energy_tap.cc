@@ -0,0 +1,214 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "energy_tap.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <deque>
+#include <vector>
+
+#include "common.h"
+
+/* max num of full chunks queued or being written, across all threads.
+ * chunks that threads are filling do not count against it */
+#define ETAP_MAX_CHUNKS 16
+
+namespace {
+struct tap_chunk {
+  char* buf;
+  size_t len; /* bytes filled */
+};
+
+/* a thread's current chunk */
+struct tap_slot {
+  tap_chunk* cur;
+};
+
+struct tap_state {
+  FILE* file;
+  size_t chunk_sz; /* a multiple of rec_sz */
+  size_t rec_sz;
+  unsigned char id_sz;
+  pthread_mutex_t mtx; /* protects everything below */
+  pthread_cond_t cv;
+  std::deque<tap_chunk*> full; /* waiting to be written */
+  std::vector<tap_chunk*> free;
+  std::vector<tap_slot*> slots;
+  size_t nchunks; /* num of chunks allocated */
+  size_t nheld; /* num of chunks being filled by threads */
+  unsigned long long nrecs; /* num of records written */
+  pthread_t writer;
+  int shutdown;
+};
+
+tap_state* state = NULL;
+__thread tap_slot* my_slot = NULL;
+
+/* REQUIRES: s->mtx has been locked */
+tap_chunk* get_chunk(tap_state* s) {
+  while (s->free.empty() && s->nchunks - s->nheld >= ETAP_MAX_CHUNKS) {
+    pthread_cv_wait(&s->cv, &s->mtx);
+  }
+  tap_chunk* c;
+  if (!s->free.empty()) {
+    c = s->free.back();
+    s->free.pop_back();
+  } else {
+    c = new tap_chunk;
+    c->buf = static_cast<char*>(malloc(s->chunk_sz));
+    if (c->buf == NULL) ABORT("malloc");
+    s->nchunks++;
+  }
+  c->len = 0;
+  s->nheld++;
+  return c;
+}
+
+tap_slot* new_slot(tap_state* s) {
+  tap_slot* slot = new tap_slot;
+  pthread_mtx_lock(&s->mtx);
+  slot->cur = get_chunk(s);
+  s->slots.push_back(slot);
+  pthread_mtx_unlock(&s->mtx);
+  return slot;
+}
+
+void* writer_main(void* arg) {
+  tap_state* const s = static_cast<tap_state*>(arg);
+  pthread_mtx_lock(&s->mtx);
+  for (;;) {
+    while (s->full.empty() && !s->shutdown) {
+      pthread_cv_wait(&s->cv, &s->mtx);
+    }
+    if (s->full.empty()) break; /* shutdown */
+    tap_chunk* const c = s->full.front();
+    s->full.pop_front();
+    pthread_mtx_unlock(&s->mtx);
+    fwrite(c->buf, 1, c->len, s->file);
+    pthread_mtx_lock(&s->mtx);
+    s->nrecs += c->len / s->rec_sz;
+    s->free.push_back(c);
+    pthread_cv_notifyall(&s->cv);
+  }
+  pthread_mtx_unlock(&s->mtx);
+  return NULL;
+}
+}  // namespace
+
+void energy_tap_open(const char* path, int rank, unsigned char id_sz,
+                     size_t chunk_sz) {
+  etap_hdr_t hdr;
+  assert(state == NULL);
+  state = new tap_state;
+  state->file = fopen(path, "w");
+  if (state->file == NULL) {
+    ABORT("!fopen");
+  }
+  /* chunks are written out directly, so the file needs no buffer */
+  setvbuf(state->file, NULL, _IONBF, 0);
+  state->id_sz = id_sz;
+  state->rec_sz = ETAP_REC_FIXED + id_sz;
+  if (chunk_sz < state->rec_sz) chunk_sz = state->rec_sz;
+  state->chunk_sz = chunk_sz - chunk_sz % state->rec_sz;
+  state->nchunks = 0;
+  state->nheld = 0;
+  state->nrecs = 0;
+  state->shutdown = 0;
+  pthread_mutex_init(&state->mtx, NULL);
+  pthread_cond_init(&state->cv, NULL);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, ETAP_MAGIC, 8);
+  hdr.rank = static_cast<uint32_t>(rank);
+  hdr.id_sz = id_sz;
+  hdr.rec_sz = static_cast<uint32_t>(state->rec_sz);
+  fwrite(&hdr, sizeof(hdr), 1, state->file);
+
+  int rv = pthread_create(&state->writer, NULL, writer_main, state);
+  if (rv) ABORT("pthread_create");
+}
+
+void energy_tap_add(const char* id, int epoch, float time, double energy) {
+  tap_state* const s = state;
+  if (s == NULL) return;
+  tap_slot* slot = my_slot;
+  if (slot == NULL) {
+    slot = my_slot = new_slot(s);
+  }
+  tap_chunk* const c = slot->cur;
+  char* const p = c->buf + c->len;
+  const int32_t ep = epoch;
+  memcpy(p, &ep, 4);
+  memcpy(p + 4, &time, 4);
+  memcpy(p + 8, &energy, 8);
+  memcpy(p + ETAP_REC_FIXED, id, s->id_sz);
+  c->len += s->rec_sz;
+  if (c->len == s->chunk_sz) {
+    pthread_mtx_lock(&s->mtx);
+    s->full.push_back(c);
+    s->nheld--;
+    pthread_cv_notifyall(&s->cv);
+    slot->cur = get_chunk(s);
+    pthread_mtx_unlock(&s->mtx);
+  }
+}
+
+unsigned long long energy_tap_close() {
+  unsigned long long nrecs;
+  if (state == NULL) return 0;
+  pthread_mtx_lock(&state->mtx);
+  state->shutdown = 1;
+  pthread_cv_notifyall(&state->cv);
+  pthread_mtx_unlock(&state->mtx);
+  pthread_join(state->writer, NULL);
+
+  /* partially filled chunks go last */
+  for (size_t i = 0; i < state->slots.size(); i++) {
+    tap_chunk* const c = state->slots[i]->cur;
+    if (c->len != 0) {
+      fwrite(c->buf, 1, c->len, state->file);
+      state->nrecs += c->len / state->rec_sz;
+      c->len = 0;
+    }
+  }
+  fclose(state->file);
+  state->file = NULL;
+  nrecs = state->nrecs;
+
+  /* particles tapped after this point are ignored. chunks are not freed
+   * since other threads may still be holding them */
+  state = NULL;
+  return nrecs;
+}
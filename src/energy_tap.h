@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * energy_tap.h  binary per-particle energy records.
+ *
+ * with SHUFFLE_Energy_tap_dir, the shuffle udf records the id, simulation
+ * time, and energy of every particle it routes. each thread appends
+ * fixed-size records to a chunk of its own, without locks. full chunks
+ * are handed to a background thread that writes them out to a per-rank
+ * file with large sequential writes. a thread waits for the writer only
+ * if too many full chunks are queued, so no record is ever dropped.
+ *
+ * file format: an etap_hdr followed by records of rec_sz bytes each:
+ *
+ *   epoch (int32), time (f32), energy (f64), id (id_sz bytes)
+ *
+ * all fields are in host byte order (see tools/preload_energy_tap_reader.cc).
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define ETAP_MAGIC "VPICETP1"
+
+typedef struct etap_hdr {
+  char magic[8];   /* ETAP_MAGIC */
+  uint32_t rank;   /* MPI rank */
+  uint32_t id_sz;  /* bytes of each particle id */
+  uint32_t rec_sz; /* ETAP_REC_FIXED + id_sz */
+  uint32_t reserved;
+} etap_hdr_t;
+
+/* bytes of each record before the particle id */
+#define ETAP_REC_FIXED 16
+
+/* start tapping into the given file with chunks of chunk_sz bytes.
+ * abort on errors */
+extern void energy_tap_open(const char* path, int rank, unsigned char id_sz,
+                            size_t chunk_sz);
+
+/* add a particle to the calling thread's chunk. id must be id_sz bytes */
+extern void energy_tap_add(const char* id, int epoch, float time,
+                           double energy);
+
+/* write out all chunks, stop the background writer, and close the file.
+ * return the total num of records written */
+extern unsigned long long energy_tap_close();
@@ -23,8 +23,14 @@
 #include <cstring>
 #include <cmath>
 #include <cerrno>
+#include <cassert>
+#include <algorithm>
+#include <utility>
+#include <vector>
 
+#include "preload_internal.h"
 #include "preload_shuffle.h"
+#include "loadbalance_util.h"
 
 /* Coefficients in rational approximations. */
 static const double a[] =
@@ -124,38 +130,490 @@ int gaussian_buckets(double mu, double sigma, double *bucket_out, int n) {
   return 0;
 }
 
+/*
+ * equi_depth_buckets: cut the weighted samples gathered from all ranks
+ * into nbins ranges of equal weight. counts[r] samples of weight
+ * weights[r] start at all[displs[r]]. the first and the last bucket
+ * boundaries are set to -inf and +inf.
+ */
+static void equi_depth_buckets(const std::vector<double> &all,
+                               const std::vector<int> &counts,
+                               const std::vector<int> &displs,
+                               const std::vector<double> &weights,
+                               double *bucket_out, int nbins) {
+  std::vector<std::pair<double, double> > merged(all.size());
+  double total_weight = 0;
+  for (size_t r = 0; r < counts.size(); r++) {
+    for (int i = 0; i < counts[r]; i++) {
+      merged[displs[r] + i] = std::make_pair(all[displs[r] + i], weights[r]);
+    }
+    total_weight += counts[r] * weights[r];
+  }
+  std::sort(merged.begin(), merged.end());
+
+  bucket_out[0] = -HUGE_VAL;
+  bucket_out[nbins] = HUGE_VAL;
+  size_t j = 0;
+  double cum = 0;
+  for (int i = 1; i < nbins; i++) {
+    const double target = i * total_weight / nbins;
+    while (j < merged.size() && cum + merged[j].second < target) {
+      cum += merged[j].second;
+      j++;
+    }
+    if (j < merged.size()) {
+      bucket_out[i] = merged[j].first;
+    } else {
+      bucket_out[i] = merged.empty() ? 0 : merged.back().first;
+    }
+  }
+}
+
+void pivot_init(pivot_negotiation *pn, MPI_Comm comm) {
+  int rv = MPI_Comm_dup(comm, &pn->comm);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Comm_dup");
+  }
+  MPI_Comm_size(pn->comm, &pn->nranks);
+  pn->state = PIVOT_IDLE;
+  pn->drift = 0;
+  pn->req = MPI_REQUEST_NULL;
+}
+
+void pivot_destroy(pivot_negotiation *pn) {
+  assert(pn->state == PIVOT_IDLE || pn->state == PIVOT_DONE);
+  MPI_Comm_free(&pn->comm);
+}
+
+/*
+ * pivot_start: join the negotiation with the n energies staged by us.
+ * with the gaussian method only the moments of the energies are sent.
+ * otherwise, energies are summarized by (up to) nsamples evenly spaced
+ * order statistics, each standing in for n/nsamples particles.
+ */
+void pivot_start(pivot_negotiation *pn, int method, const double *energies,
+                 size_t n, int nsamples) {
+  assert(pn->state == PIVOT_IDLE || pn->state == PIVOT_DONE);
+  pn->method = method;
+
+  if (method == SHUFFLE_PIVOT_GAUSSIAN) {
+    pn->moments[0] = pn->moments[1] = 0;
+    for (size_t i = 0; i < n; i++) {
+      pn->moments[0] += energies[i];
+      pn->moments[1] += energies[i] * energies[i];
+    }
+    pn->moments[2] = double(n);
+    pn->state = PIVOT_EXCHANGE_MOMENTS;
+#if MPI_VERSION >= 3
+    MPI_Iallreduce(pn->moments, pn->all_moments, 3, MPI_DOUBLE, MPI_SUM,
+                   pn->comm, &pn->req);
+#else
+    MPI_Allreduce(pn->moments, pn->all_moments, 3, MPI_DOUBLE, MPI_SUM,
+                  pn->comm);
+    pn->req = MPI_REQUEST_NULL;
+#endif
+    return;
+  }
+
+  std::vector<double> sorted(energies, energies + n);
+  std::sort(sorted.begin(), sorted.end());
+  const int k = (nsamples > 0 && size_t(nsamples) < n) ? nsamples : int(n);
+  pn->summary.resize(k);
+  for (int i = 0; i < k; i++) {
+    pn->summary[i] = sorted[size_t((i + 0.5) * n / k)];
+  }
+  pn->meta[0] = k;
+  pn->meta[1] = (k != 0) ? double(n) / k : 0;
+  pn->all_meta.resize(2 * pn->nranks);
+  pn->state = PIVOT_EXCHANGE_COUNTS;
+#if MPI_VERSION >= 3
+  MPI_Iallgather(pn->meta, 2, MPI_DOUBLE, &pn->all_meta[0], 2, MPI_DOUBLE,
+                 pn->comm, &pn->req);
+#else
+  MPI_Allgather(pn->meta, 2, MPI_DOUBLE, &pn->all_meta[0], 2, MPI_DOUBLE,
+                pn->comm);
+  pn->req = MPI_REQUEST_NULL;
+#endif
+}
+
+void pivot_drift_start(pivot_negotiation *pn, const double *buckets,
+                       int nbins, const double *energies, size_t n) {
+  assert(pn->state == PIVOT_IDLE || pn->state == PIVOT_DONE);
+  std::vector<int> bins(n);
+  if (n != 0) {
+    binary_search_batch(buckets, nbins, energies, &bins[0], n);
+  }
+  pn->bin_counts.assign(nbins, 0);
+  for (size_t i = 0; i < n; i++) {
+    const int b = bins[i] < 0 ? 0 : (bins[i] >= nbins ? nbins - 1 : bins[i]);
+    pn->bin_counts[b] += 1;
+  }
+  pn->all_bin_counts.resize(nbins);
+  pn->state = PIVOT_EXCHANGE_DRIFT;
+#if MPI_VERSION >= 3
+  MPI_Iallreduce(&pn->bin_counts[0], &pn->all_bin_counts[0], nbins,
+                 MPI_DOUBLE, MPI_SUM, pn->comm, &pn->req);
+#else
+  MPI_Allreduce(&pn->bin_counts[0], &pn->all_bin_counts[0], nbins,
+                MPI_DOUBLE, MPI_SUM, pn->comm);
+  pn->req = MPI_REQUEST_NULL;
+#endif
+}
+
+/*
+ * pivot_progress: advance the negotiation as far as it can go, blocking
+ * on each pending exchange if block is set. return 1 if bucket_out
+ * has been filled, or 0 otherwise.
+ */
+static int pivot_progress(pivot_negotiation *pn, double *bucket_out,
+                          int nbins, int block) {
+  int flag;
+
+  while (pn->state != PIVOT_IDLE && pn->state != PIVOT_DONE) {
+    if (block) {
+      MPI_Wait(&pn->req, MPI_STATUS_IGNORE);
+    } else {
+      MPI_Test(&pn->req, &flag, MPI_STATUS_IGNORE);
+      if (!flag) {
+        return 0;
+      }
+    }
+
+    if (pn->state == PIVOT_EXCHANGE_DRIFT) {
+      const std::vector<double> &c = pn->all_bin_counts;
+      double total = 0;
+      for (size_t i = 0; i < c.size(); i++) {
+        total += c[i];
+      }
+      double cum = 0;
+      pn->drift = 0;
+      for (size_t i = 1; i < c.size() && total > 0; i++) {
+        cum += c[i - 1];
+        const double d = fabs(cum / total - double(i) / c.size());
+        if (d > pn->drift) {
+          pn->drift = d;
+        }
+      }
+      pn->state = PIVOT_DONE;
+    } else if (pn->state == PIVOT_EXCHANGE_MOMENTS) {
+      const double num = pn->all_moments[2];
+      double mu = 0;
+      double sigma = 1;
+      if (num > 0) {
+        mu = pn->all_moments[0] / num;
+        const double sigma2 = pn->all_moments[1] / num - mu * mu;
+        sigma = sigma2 > 0 ? sqrt(sigma2) : 0;
+      }
+      gaussian_buckets(mu, sigma, bucket_out, nbins);
+      pn->state = PIVOT_DONE;
+    } else if (pn->state == PIVOT_EXCHANGE_COUNTS) {
+      pn->counts.resize(pn->nranks);
+      pn->displs.resize(pn->nranks);
+      pn->weights.resize(pn->nranks);
+      int total = 0;
+      for (int r = 0; r < pn->nranks; r++) {
+        pn->counts[r] = int(pn->all_meta[2 * r]);
+        pn->weights[r] = pn->all_meta[2 * r + 1];
+        pn->displs[r] = total;
+        total += pn->counts[r];
+      }
+      pn->all_samples.resize(total);
+      pn->state = PIVOT_EXCHANGE_SAMPLES;
+      double *const sendbuf = pn->summary.empty() ? NULL : &pn->summary[0];
+      double *const recvbuf =
+          pn->all_samples.empty() ? NULL : &pn->all_samples[0];
+#if MPI_VERSION >= 3
+      MPI_Iallgatherv(sendbuf, int(pn->summary.size()), MPI_DOUBLE, recvbuf,
+                      &pn->counts[0], &pn->displs[0], MPI_DOUBLE, pn->comm,
+                      &pn->req);
+#else
+      MPI_Allgatherv(sendbuf, int(pn->summary.size()), MPI_DOUBLE, recvbuf,
+                     &pn->counts[0], &pn->displs[0], MPI_DOUBLE, pn->comm);
+      pn->req = MPI_REQUEST_NULL;
+#endif
+    } else {
+      assert(pn->state == PIVOT_EXCHANGE_SAMPLES);
+      equi_depth_buckets(pn->all_samples, pn->counts, pn->displs,
+                         pn->weights, bucket_out, nbins);
+      pn->state = PIVOT_DONE;
+    }
+  }
+
+  return pn->state == PIVOT_DONE;
+}
+
+int pivot_test(pivot_negotiation *pn, double *bucket_out, int nbins) {
+  return pivot_progress(pn, bucket_out, nbins, 0);
+}
+
+void pivot_wait(pivot_negotiation *pn, double *bucket_out, int nbins) {
+  assert(pn->state != PIVOT_IDLE);
+  pivot_progress(pn, bucket_out, nbins, 1);
+}
+
+void rebalance_init(rebalancer *rb, MPI_Comm comm, int nbins) {
+  int rv = MPI_Comm_dup(comm, &rb->comm);
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Comm_dup");
+  }
+  rb->nbins = nbins;
+  rb->rounds_started = 0;
+  rb->in_flight = 0;
+  rb->req[0] = rb->req[1] = MPI_REQUEST_NULL;
+  rb->counts.assign(nbins, 0);
+  rb->all_counts.resize(nbins);
+  rb->range[0] = rb->range[1] = -HUGE_VAL;
+}
+
+void rebalance_destroy(rebalancer *rb) {
+  assert(!rb->in_flight);
+  MPI_Comm_free(&rb->comm);
+}
+
+void rebalance_reset(rebalancer *rb, const double *bins,
+                     const double *energies, size_t n) {
+  assert(!rb->in_flight);
+  rb->rounds_started = 0;
+  rb->maps.assign(1, std::vector<double>(bins, bins + rb->nbins + 1));
+  rb->counts.assign(rb->nbins, 0);
+  rb->range[0] = rb->range[1] = -HUGE_VAL;
+  if (n != 0) {
+    std::vector<int> b(n);
+    binary_search_batch(bins, rb->nbins, energies, &b[0], n);
+    for (size_t i = 0; i < n; i++) {
+      const int x = b[i] < 0 ? 0 : (b[i] >= rb->nbins ? rb->nbins - 1 : b[i]);
+      rebalance_count(rb, x, energies[i]);
+    }
+  }
+}
+
+void rebalance_start(rebalancer *rb) {
+  assert(!rb->in_flight);
+  rb->rounds_started++;
+  rb->in_flight = 1;
+  /* particles keep being counted while the round is in flight */
+  rb->sent_counts = rb->counts;
+  rb->sent_range[0] = rb->range[0];
+  rb->sent_range[1] = rb->range[1];
+#if MPI_VERSION >= 3
+  MPI_Iallreduce(&rb->sent_counts[0], &rb->all_counts[0], rb->nbins,
+                 MPI_DOUBLE, MPI_SUM, rb->comm, &rb->req[0]);
+  MPI_Iallreduce(rb->sent_range, rb->all_range, 2, MPI_DOUBLE, MPI_MAX,
+                 rb->comm, &rb->req[1]);
+#else
+  MPI_Allreduce(&rb->sent_counts[0], &rb->all_counts[0], rb->nbins,
+                MPI_DOUBLE, MPI_SUM, rb->comm);
+  MPI_Allreduce(rb->sent_range, rb->all_range, 2, MPI_DOUBLE, MPI_MAX,
+                rb->comm);
+  rb->req[0] = rb->req[1] = MPI_REQUEST_NULL;
+#endif
+}
+
+int rebalance_test(rebalancer *rb, double *bins, double threshold,
+                   int wait) {
+  int flag;
+
+  assert(rb->in_flight);
+  if (wait) {
+    MPI_Waitall(2, rb->req, MPI_STATUSES_IGNORE);
+  } else {
+    MPI_Testall(2, rb->req, &flag, MPI_STATUSES_IGNORE);
+    if (!flag) {
+      return 0;
+    }
+  }
+  rb->in_flight = 0;
+
+  const int n = rb->nbins;
+  const std::vector<double> &c = rb->all_counts;
+  double total = 0;
+  double busiest = 0;
+  for (int i = 0; i < n; i++) {
+    total += c[i];
+    if (c[i] > busiest) busiest = c[i];
+  }
+  if (total == 0 || busiest * n <= threshold * total ||
+      int(rb->maps.size()) >= SHUFFLE_MAX_MAP_VERSIONS) {
+    return 0;
+  }
+
+  /* particles are taken as spread evenly within each bin. the two outer
+   * bins are bounded by the min and max energy seen. */
+  const double lo = -rb->all_range[1];
+  const double hi = rb->all_range[0];
+  std::vector<double> refined(n + 1);
+  refined[0] = -HUGE_VAL;
+  refined[n] = HUGE_VAL;
+  int b = 0;
+  double cum = 0;
+  for (int i = 1; i < n; i++) {
+    const double target = i * total / n;
+    while (b < n - 1 && cum + c[b] < target) {
+      cum += c[b];
+      b++;
+    }
+    const double left = (b == 0) ? lo : bins[b];
+    const double right = (b == n - 1) ? hi : bins[b + 1];
+    const double frac = (c[b] > 0) ? (target - cum) / c[b] : 0;
+    double p = left + (right - left) * (frac < 1 ? frac : 1);
+    if (p < refined[i - 1]) p = refined[i - 1];
+    refined[i] = p;
+  }
+
+  std::copy(refined.begin(), refined.end(), bins);
+  rb->maps.push_back(refined);
+  rb->counts.assign(n, 0);
+  rb->range[0] = rb->range[1] = -HUGE_VAL;
+  return 1;
+}
+
 double compute_energy(double ux, double uy, double uz) {
   double tmp = 1 + ux*ux + uy*uy + uz*uz;
   return sqrt(tmp);
 }
 
 double compute_energy(const char *data_blob) {
-  float f[10];
-  memcpy(f, data_blob, 40);
+  const particle_schema_t *s = &pctx.pschema;
+  return compute_energy(pschema_get(s, s->ux, data_blob),
+                        pschema_get(s, s->uy, data_blob),
+                        pschema_get(s, s->uz, data_blob));
+}
 
-  double energy = compute_energy(f[5], f[6], f[7]);
-  return energy;
+/*
+ * compute_energy_batch: compute_energy() for n particles laid out stride
+ * bytes apart. momenta are first gathered into one array per component so
+ * that the sqrt() loop is vectorized by the compiler (this file is built
+ * with -fno-math-errno; 1 + u^2 is never negative). if sums is not NULL,
+ * the sum of the energies and of their squares are added to sums[0] and
+ * sums[1].
+ */
+void compute_energy_batch(const char *data, size_t stride, size_t n,
+                          double *energies, double *sums) {
+  const particle_schema_t *s = &pctx.pschema;
+  const size_t group = 64;
+  double ux[group], uy[group], uz[group];
+
+  for (size_t i = 0; i < n; i += group) {
+    const size_t k = (n - i < group) ? n - i : group;
+    const char *const p = data + i * stride;
+    for (size_t j = 0; j < k; j++) {
+      ux[j] = pschema_get(s, s->ux, p + j * stride);
+      uy[j] = pschema_get(s, s->uy, p + j * stride);
+      uz[j] = pschema_get(s, s->uz, p + j * stride);
+    }
+    double *const e = energies + i;
+    for (size_t j = 0; j < k; j++) {
+      e[j] = sqrt(1 + ux[j] * ux[j] + uy[j] * uy[j] + uz[j] * uz[j]);
+    }
+    if (sums != NULL) {
+      double sum = 0, sum2 = 0;
+      for (size_t j = 0; j < k; j++) {
+        sum += e[j];
+        sum2 += e[j] * e[j];
+      }
+      sums[0] += sum;
+      sums[1] += sum2;
+    }
+  }
 }
 
+/* initial num of staged records, enough for a negotiation round */
+#define STAGE_MIN_RECORDS 1024
+
+/*
+ * buffer_write: stage a write until energy bins are available. records are
+ * appended to the stage arena without per-record allocation.
+ */
 int buffer_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
+                  unsigned char fname_len, char* data, unsigned int data_len,
                   int epoch) {
-  std::string fname_copy (fname, fname_len);
-  std::string data_copy (data, data_len);
-  ctx->temp_buffer[fname_copy] = data_copy;
+  if (ctx->fname_len != fname_len) ABORT("bad filename len");
+  if (ctx->data_len != data_len) ABORT("bad data len");
+  if (ctx->stage_num == ctx->stage_cap) {
+    ctx->stage_rec_sz = (4 + size_t(fname_len) + 1 + data_len + 7) & ~size_t(7);
+    ctx->stage_cap = ctx->stage_cap ? 2 * ctx->stage_cap : STAGE_MIN_RECORDS;
+    ctx->stage = static_cast<char *>(
+        realloc(ctx->stage, ctx->stage_cap * ctx->stage_rec_sz));
+    if (ctx->stage == NULL) ABORT("realloc");
+  }
+  char *const rec = ctx->stage + ctx->stage_num * ctx->stage_rec_sz;
+  memcpy(rec, &epoch, 4);
+  memcpy(rec + 4, fname, fname_len);
+  rec[4 + fname_len] = 0;
+  memcpy(rec + 4 + fname_len + 1, data, data_len);
+  ctx->stage_num++;
   return 0;
 }
 
-int binary_search(double *buckets, int n, double energy) {
-  // printf("--> Looking for %lf: ", energy);
-  for(int i = n; i >= 0; i--) {
-    // printf("[%d]%lf ", i, buckets[i]);
-    if (buckets[i] < energy) {
-      // printf("\n--> selected %d\n", i);
-      return i;
+/*
+ * buffer_flush: replay all staged writes through shuffle_write(), in the
+ * order they were staged, and empty the stage. return 0 on success, or
+ * EOF on errors.
+ */
+int buffer_flush(shuffle_ctx_t* ctx, size_t *n) {
+  int rv = 0;
+  for (size_t i = 0; i < ctx->stage_num; i++) {
+    char *const rec = ctx->stage + i * ctx->stage_rec_sz;
+    int epoch;
+    memcpy(&epoch, rec, 4);
+    if (shuffle_write(ctx, rec + 4, ctx->fname_len,
+                      rec + 4 + ctx->fname_len + 1, ctx->data_len,
+                      epoch) != 0) {
+      rv = EOF;
+    }
+  }
+  if (n != NULL) *n = ctx->stage_num;
+  ctx->stage_num = 0;
+  return rv;
+}
+
+/*
+ * binary_search: return the largest i in [0, n] such that buckets[i] <
+ * energy, or -1 if there is no such i. buckets holds n + 1 bounds sorted in
+ * ascending order. this is a branchless lower bound: the loop runs exactly
+ * ceil(log2(n + 1)) times regardless of the input and compiles to
+ * conditional moves.
+ */
+int binary_search(const double *buckets, int n, double energy) {
+  const double *base = buckets;
+  size_t len = size_t(n) + 1;
+  while (len > 1) {
+    const size_t half = len / 2;
+    base = (base[half - 1] < energy) ? base + half : base;
+    len -= half;
+  }
+  return int(base - buckets) + (*base < energy) - 1;
+}
+
+/*
+ * binary_search_batch: binary_search() for m energies at once. all searches
+ * take the same sequence of steps, so they are run in lockstep, a group at
+ * a time, which keeps many independent loads in flight and lets the
+ * compiler vectorize the inner loop.
+ */
+void binary_search_batch(const double *buckets, int n, const double *energies,
+                         int *out, size_t m) {
+  const size_t group = 16;
+  size_t idx[group];
+
+  for (size_t i = 0; i < m; i += group) {
+    const size_t k = (m - i < group) ? m - i : group;
+    const double *const e = energies + i;
+    for (size_t j = 0; j < k; j++) {
+      idx[j] = 0;
+    }
+    size_t len = size_t(n) + 1;
+    while (len > 1) {
+      const size_t half = len / 2;
+      for (size_t j = 0; j < k; j++) {
+        idx[j] += (buckets[idx[j] + half - 1] < e[j]) ? half : 0;
+      }
+      len -= half;
+    }
+    for (size_t j = 0; j < k; j++) {
+      out[i + j] = int(idx[j]) + (buckets[idx[j]] < e[j]) - 1;
     }
   }
-  return -1;
 }
 
 int get_buckets(double px, double px2, double py, double py2,
@@ -1,16 +1,136 @@
 #pragma once
 
+#include <mpi.h>
+#include <vector>
+
 int get_buckets(double px, double px2, double py, double py2,
     double pz, double pz2, double *buckets, long int n, int nproc);
 
 int gaussian_buckets(double mu, double sigma, double *bucket_out, int n);
 
+/*
+ * pivot_negotiation: energy bins negotiated with nonblocking collectives
+ * on a private communicator, so ranks keep staging particles while they
+ * wait for their peers. every rank must eventually pivot_start(); the
+ * bins are ready once pivot_test() returns 1 or pivot_wait() returns.
+ * without MPI-3, every exchange blocks inside pivot_start().
+ */
+struct pivot_negotiation {
+  MPI_Comm comm;
+  int nranks;
+  int method; /* SHUFFLE_PIVOT_SAMPLE or SHUFFLE_PIVOT_GAUSSIAN */
+  int state;
+#define PIVOT_IDLE 0
+#define PIVOT_EXCHANGE_MOMENTS 1 /* gaussian: sum, sum of squares, num */
+#define PIVOT_EXCHANGE_COUNTS 2  /* sample: num of samples and their weight */
+#define PIVOT_EXCHANGE_SAMPLES 3 /* sample: the samples themselves */
+#define PIVOT_EXCHANGE_DRIFT 4   /* per-bin counts of a drift check */
+#define PIVOT_DONE 5
+  MPI_Request req;
+  double moments[3];
+  double all_moments[3];
+  double meta[2];
+  std::vector<double> all_meta;
+  std::vector<double> summary;
+  std::vector<double> all_samples;
+  std::vector<double> weights;
+  std::vector<int> counts;
+  std::vector<int> displs;
+  std::vector<double> bin_counts;
+  std::vector<double> all_bin_counts;
+  double drift; /* result of the last drift check */
+};
+
+void pivot_init(pivot_negotiation *pn, MPI_Comm comm);
+
+void pivot_start(pivot_negotiation *pn, int method, const double *energies,
+                 size_t n, int nsamples);
+
+/*
+ * pivot_drift_start: instead of negotiating new bins, measure how far the
+ * energies staged by all ranks have drifted from the current ones. once
+ * the check completes, pn->drift holds the KS distance between the
+ * sampled distribution and the one the bins were cut for (equal weight
+ * per bin), as in max_i |F(bucket[i]) - i/nbins|. bucket_out is not
+ * touched.
+ */
+void pivot_drift_start(pivot_negotiation *pn, const double *buckets,
+                       int nbins, const double *energies, size_t n);
+
+int pivot_test(pivot_negotiation *pn, double *bucket_out, int nbins);
+
+void pivot_wait(pivot_negotiation *pn, double *bucket_out, int nbins);
+
+void pivot_destroy(pivot_negotiation *pn);
+
+/*
+ * rebalancer: refines the energy bins of an epoch while it runs. in each
+ * round, ranks sum up with a nonblocking allreduce how many particles they
+ * routed to each bin since the last map version, along with the range of
+ * energies seen. if the busiest bin exceeds the average by more than a
+ * threshold, every rank re-cuts the bins so that the observed load would
+ * have been spread evenly (interpolating linearly within each bin) and
+ * installs them as the next map version. all ranks see the same sums and
+ * so agree on every version. rounds run on a private communicator and a
+ * rank starts a round only after its previous one has completed, so at
+ * most one round is in flight.
+ */
+struct rebalancer {
+  MPI_Comm comm;
+  int nbins;
+  int rounds_started; /* in the current epoch */
+  int in_flight;
+  MPI_Request req[2];
+  std::vector<double> counts; /* particles per bin under the current map */
+  std::vector<double> sent_counts; /* snapshot of counts being reduced */
+  std::vector<double> all_counts;
+  double range[2]; /* max energy and -min energy seen */
+  double sent_range[2];
+  double all_range[2];
+  /* pivots of each map version of the current epoch */
+  std::vector<std::vector<double> > maps;
+};
+
+void rebalance_init(rebalancer *rb, MPI_Comm comm, int nbins);
+
+/*
+ * rebalance_reset: start a new epoch with bins as map version 0. the n
+ * energies already routed with them are counted as its first load.
+ */
+void rebalance_reset(rebalancer *rb, const double *bins,
+                     const double *energies, size_t n);
+
+inline void rebalance_count(rebalancer *rb, int bin, double energy) {
+  rb->counts[bin] += 1;
+  if (energy > rb->range[0]) rb->range[0] = energy;
+  if (-energy > rb->range[1]) rb->range[1] = -energy;
+}
+
+void rebalance_start(rebalancer *rb);
+
+/*
+ * rebalance_test: if the round in flight has completed, return 1 and
+ * store the refined bins in bins if the round published a new map
+ * version, or return 0 otherwise. block if wait is set.
+ */
+int rebalance_test(rebalancer *rb, double *bins, double threshold, int wait);
+
+void rebalance_destroy(rebalancer *rb);
+
 double compute_energy(double ux, double uy, double uz);
 
 double compute_energy(const char *data_blob);
 
+void compute_energy_batch(const char *data, size_t stride, size_t n,
+                          double *energies, double *sums);
+
 int buffer_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
+                  unsigned char fname_len, char* data, unsigned int data_len,
                   int epoch);
 
-int binary_search(double *buckets, int n, double energy);
+int buffer_flush(shuffle_ctx_t* ctx, size_t *n);
+
+int binary_search(const double *buckets, int n, double energy);
+
+void binary_search_batch(const double *buckets, int n, const double *energies,
+                         int *out, size_t m);
@@ -0,0 +1,172 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "local_deliv.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <string.h>
+
+#include "common.h"
+#include "preload_internal.h"
+
+/* num of empty polls before the delivery thread goes to sleep */
+#define LOCAL_DELIV_SPINS 256
+
+namespace {
+inline char* slot(local_deliv_t* ld, uint64_t seq) {
+  return ld->slots + (seq & (ld->num_slots - 1)) * ld->slot_sz;
+}
+
+int deliver(local_deliv_t* ld, char* s) {
+  int epoch;
+  memcpy(&epoch, s, 4);
+  return native_write(s + 4, ld->fname_len, s + 4 + ld->fname_len + 1,
+                      ld->data_len, epoch);
+}
+
+void* local_deliv_main(void* arg) {
+  local_deliv_t* const ld = static_cast<local_deliv_t*>(arg);
+  int spins = 0;
+
+  while (true) {
+    const uint64_t tail = ld->tail;
+    if (tail != ld->head) {
+      __sync_synchronize(); /* read the slot after seeing it published */
+      if (deliver(ld, slot(ld, tail)) != 0) {
+        ABORT("plfsdir local delivery failed");
+      }
+      __sync_synchronize(); /* finish with the slot before releasing it */
+      ld->tail = tail + 1;
+      __sync_synchronize(); /* release the slot before checking draining */
+      spins = 0;
+      if (ld->draining) {
+        pthread_mtx_lock(&ld->mtx);
+        pthread_cv_notifyall(&ld->cv);
+        pthread_mtx_unlock(&ld->mtx);
+      }
+    } else if (++spins < LOCAL_DELIV_SPINS) {
+      sched_yield();
+    } else {
+      pthread_mtx_lock(&ld->mtx);
+      ld->sleeping = 1;
+      __sync_synchronize();
+      while (ld->tail == ld->head && !ld->shutdown) {
+        pthread_cv_wait(&ld->cv, &ld->mtx);
+      }
+      ld->sleeping = 0;
+      const int done = ld->shutdown && ld->tail == ld->head;
+      pthread_mtx_unlock(&ld->mtx);
+      if (done) break;
+      spins = 0;
+    }
+  }
+
+  return NULL;
+}
+}  // namespace
+
+void local_deliv_init(local_deliv_t* ld, size_t num_slots,
+                      unsigned char fname_len, unsigned int data_len) {
+  memset(ld, 0, sizeof(*ld));
+  ld->num_slots = 1;
+  while (ld->num_slots < num_slots) ld->num_slots <<= 1;
+  ld->fname_len = fname_len;
+  ld->data_len = data_len;
+  ld->slot_sz = (4 + size_t(fname_len) + 1 + data_len + 7) & ~size_t(7);
+  ld->slots = static_cast<char*>(malloc(ld->num_slots * ld->slot_sz));
+  if (ld->slots == NULL) {
+    ABORT("malloc");
+  }
+
+  pthread_mutex_init(&ld->pmtx, NULL);
+  pthread_mutex_init(&ld->mtx, NULL);
+  pthread_cond_init(&ld->cv, NULL);
+  int rv = pthread_create(&ld->thread, NULL, local_deliv_main, ld);
+  if (rv) ABORT("pthread_create");
+}
+
+int local_deliv_enqueue(local_deliv_t* ld, const char* fname,
+                        const char* data, int epoch) {
+  pthread_mtx_lock(&ld->pmtx);
+  const uint64_t head = ld->head;
+  if (head - ld->tail >= ld->num_slots) {
+    ld->ninline++;
+    pthread_mtx_unlock(&ld->pmtx);
+    return native_write(fname, ld->fname_len, const_cast<char*>(data),
+                        ld->data_len, epoch);
+  }
+
+  char* const s = slot(ld, head);
+  memcpy(s, &epoch, 4);
+  memcpy(s + 4, fname, ld->fname_len);
+  s[4 + ld->fname_len] = 0;
+  memcpy(s + 4 + ld->fname_len + 1, data, ld->data_len);
+  __sync_synchronize(); /* publish the slot before the new head */
+  ld->head = head + 1;
+  ld->nq++;
+  pthread_mtx_unlock(&ld->pmtx);
+
+  __sync_synchronize();
+  if (ld->sleeping) {
+    pthread_mtx_lock(&ld->mtx);
+    pthread_cv_notifyall(&ld->cv);
+    pthread_mtx_unlock(&ld->mtx);
+  }
+
+  return 0;
+}
+
+void local_deliv_drain(local_deliv_t* ld) {
+  pthread_mtx_lock(&ld->mtx);
+  ld->draining = 1;
+  __sync_synchronize();
+  pthread_cv_notifyall(&ld->cv); /* in case the consumer is asleep */
+  while (ld->tail != ld->head) {
+    pthread_cv_wait(&ld->cv, &ld->mtx);
+  }
+  ld->draining = 0;
+  pthread_mtx_unlock(&ld->mtx);
+}
+
+void local_deliv_destroy(local_deliv_t* ld) {
+  pthread_mtx_lock(&ld->mtx);
+  ld->shutdown = 1;
+  pthread_cv_notifyall(&ld->cv);
+  pthread_mtx_unlock(&ld->mtx);
+  pthread_join(ld->thread, NULL);
+  assert(ld->tail == ld->head);
+
+  pthread_cond_destroy(&ld->cv);
+  pthread_mutex_destroy(&ld->mtx);
+  pthread_mutex_destroy(&ld->pmtx);
+  free(ld->slots);
+  ld->slots = NULL;
+}
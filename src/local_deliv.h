@@ -0,0 +1,92 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * local_deliv.h  hand particles destined to ourselves to a delivery thread.
+ *
+ * when the shuffle destination of a particle is the local rank (and rpcs
+ * are not forced), the particle would otherwise be written by the caller
+ * itself, which may then block on the memtable and its compaction. a
+ * local delivery queue is a fixed-size single-producer single-consumer
+ * ring of particle slots. the producer is the application thread; a
+ * dedicated consumer thread takes particles off the ring and writes them.
+ * no rpc is involved. when the ring is full, the producer writes the
+ * particle inline, as if there were no queue.
+ *
+ * producers calling from more than one thread are serialized by a mutex
+ * that is otherwise uncontended.
+ */
+
+#pragma once
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct local_deliv {
+  char* slots;      /* num_slots slots, slot_sz bytes each */
+  size_t slot_sz;   /* epoch (4 bytes), fname + \0, data */
+  uint64_t num_slots; /* power of 2 */
+  unsigned char fname_len;
+  unsigned int data_len;
+
+  /* head is only written by the producer and tail by the consumer */
+  volatile uint64_t head; /* next slot to fill */
+  char pad0[64];
+  volatile uint64_t tail; /* next slot to deliver */
+  char pad1[64];
+
+  pthread_mutex_t pmtx; /* serializes producers */
+  pthread_mutex_t mtx;  /* protects the following */
+  pthread_cond_t cv;
+  int sleeping; /* consumer is waiting for particles */
+  int draining; /* producer is waiting for the ring to empty */
+  int shutdown;
+  pthread_t thread;
+
+  /* stats */
+  unsigned long long nq;      /* particles queued */
+  unsigned long long ninline; /* particles written inline as ring was full */
+} local_deliv_t;
+
+/* start a local delivery queue of at least num_slots particles */
+extern void local_deliv_init(local_deliv_t* ld, size_t num_slots,
+                             unsigned char fname_len, unsigned int data_len);
+
+/* queue a particle for delivery, or deliver it inline if the ring is full.
+ * return 0 on success, or EOF on errors */
+extern int local_deliv_enqueue(local_deliv_t* ld, const char* fname,
+                               const char* data, int epoch);
+
+/* wait until all queued particles are delivered */
+extern void local_deliv_drain(local_deliv_t* ld);
+
+/* drain the queue, stop the delivery thread, and release resources */
+extern void local_deliv_destroy(local_deliv_t* ld);
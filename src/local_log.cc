@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "local_log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "common.h"
+
+namespace {
+/* write all n bytes or fail */
+int write_fully(int fd, const char* buf, size_t n) {
+  while (n != 0) {
+    ssize_t r = write(fd, buf, n);
+    if (r == -1) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    buf += r;
+    n -= size_t(r);
+  }
+  return 0;
+}
+
+/* orders index entries by particle id */
+struct entry_cmp {
+  const char* base;
+  size_t ent_size;
+  size_t id_size;
+
+  bool operator()(uint32_t a, uint32_t b) const {
+    return memcmp(base + size_t(a) * ent_size, base + size_t(b) * ent_size,
+                  id_size) < 0;
+  }
+};
+}  // namespace
+
+local_log::local_log()
+    : fd_(-1),
+      buf_(NULL),
+      buf_size_(0),
+      buf_used_(0),
+      off_(0),
+      id_size_(0),
+      ent_size_(0),
+      epoch_(-1),
+      bytes_written_(0),
+      files_written_(0) {}
+
+local_log::~local_log() {
+  if (fd_ != -1) {
+    close();
+  }
+  free(buf_);
+}
+
+int local_log::open(const char* dir, int rank, int log_id, size_t id_size,
+                    size_t buf_size) {
+  char tmp[32];
+  std::string path;
+
+  snprintf(tmp, sizeof(tmp), "%07d-%03d", rank, log_id);
+  prefix_ = dir;
+  prefix_ += "/";
+  path = prefix_ + "DATA-" + tmp + ".dat";
+  prefix_ += "INDEX-";
+  prefix_ += tmp;
+
+  fd_ = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd_ == -1) {
+    loge("open", path.c_str());
+    return -1;
+  }
+
+  files_written_++;
+  id_size_ = id_size;
+  ent_size_ = id_size + sizeof(uint64_t) + sizeof(uint32_t);
+  buf_size_ = buf_size;
+  buf_ = static_cast<char*>(malloc(buf_size_));
+  if (buf_ == NULL) {
+    ABORT("malloc");
+  }
+
+  return 0;
+}
+
+int local_log::append(const char* id, size_t id_len, const char* data,
+                      size_t data_len, int epoch) {
+  char ent[sizeof(uint64_t) + sizeof(uint32_t)];
+  const uint32_t sz = static_cast<uint32_t>(data_len);
+
+  if (epoch != epoch_) {
+    if (epoch_ != -1 && epoch_flush() != 0) {
+      return -1;
+    }
+    epoch_ = epoch;
+  }
+
+  /* index entry; short ids are zero-padded */
+  if (id_len >= id_size_) {
+    entries_.append(id, id_size_);
+  } else {
+    entries_.append(id, id_len);
+    entries_.append(id_size_ - id_len, '\0');
+  }
+  memcpy(ent, &off_, sizeof(uint64_t));
+  memcpy(ent + sizeof(uint64_t), &sz, sizeof(uint32_t));
+  entries_.append(ent, sizeof(ent));
+
+  /* data */
+  if (buf_used_ + data_len > buf_size_) {
+    if (flush_buffer() != 0) {
+      return -1;
+    }
+  }
+  if (data_len > buf_size_) {
+    if (write_fully(fd_, data, data_len) != 0) {
+      return -1;
+    }
+    bytes_written_ += data_len;
+  } else {
+    memcpy(buf_ + buf_used_, data, data_len);
+    buf_used_ += data_len;
+  }
+  off_ += data_len;
+
+  return 0;
+}
+
+int local_log::flush_buffer() {
+  if (buf_used_ != 0) {
+    if (write_fully(fd_, buf_, buf_used_) != 0) {
+      return -1;
+    }
+    bytes_written_ += buf_used_;
+    buf_used_ = 0;
+  }
+  return 0;
+}
+
+int local_log::write_index() {
+  local_log_index_header_t hdr;
+  char tmp[32];
+  std::string path;
+  std::string out;
+  int fd;
+  int rv;
+
+  const size_t n = entries_.size() / ent_size_;
+  std::vector<uint32_t> order(n);
+  for (size_t i = 0; i < n; i++) {
+    order[i] = static_cast<uint32_t>(i);
+  }
+  entry_cmp cmp;
+  cmp.base = entries_.data();
+  cmp.ent_size = ent_size_;
+  cmp.id_size = id_size_;
+  std::sort(order.begin(), order.end(), cmp);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, LOCAL_LOG_INDEX_MAGIC, sizeof(hdr.magic));
+  hdr.id_size = static_cast<uint32_t>(id_size_);
+  hdr.epoch = static_cast<uint32_t>(epoch_);
+  hdr.num_entries = n;
+  out.reserve(sizeof(hdr) + entries_.size());
+  out.append(reinterpret_cast<const char*>(&hdr), sizeof(hdr));
+  for (size_t i = 0; i < n; i++) {
+    out.append(entries_.data() + size_t(order[i]) * ent_size_, ent_size_);
+  }
+
+  snprintf(tmp, sizeof(tmp), "-%05d.idx", epoch_);
+  path = prefix_ + tmp;
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) {
+    loge("open", path.c_str());
+    return -1;
+  }
+  rv = write_fully(fd, out.data(), out.size());
+  ::close(fd);
+  if (rv != 0) {
+    return -1;
+  }
+
+  files_written_++;
+  bytes_written_ += out.size();
+  entries_.clear();
+  return 0;
+}
+
+int local_log::epoch_flush() {
+  if (flush_buffer() != 0) {
+    return -1;
+  }
+  if (epoch_ != -1) {
+    if (write_index() != 0) {
+      return -1;
+    }
+    epoch_ = -1;
+  }
+  return 0;
+}
+
+int local_log::close() {
+  int rv = epoch_flush();
+  if (::close(fd_) != 0) {
+    rv = -1;
+  }
+  fd_ = -1;
+  return rv;
+}
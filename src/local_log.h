@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * local_log.h  append-only particle logs on the local file system.
+ *
+ * this is what we write to when deltafs is bypassed. particle records are
+ * appended to a data log through a large write buffer. the id, offset, and
+ * size of every record in the current epoch are kept in memory and are
+ * written to a separate index file, sorted by id, when the epoch is
+ * flushed. all files of a log are placed under a single directory:
+ *
+ *   DATA-<rank>-<log>.dat            concatenated particle records
+ *   INDEX-<rank>-<log>-<epoch>.idx   a header followed by index entries
+ *
+ * each index entry is the particle id (id_size bytes) followed by a 64-bit
+ * offset and a 32-bit size, all packed and in host byte order. epochs
+ * without any records get no index file.
+ *
+ * a log is not thread-safe. callers must serialize access.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <string>
+
+#define LOCAL_LOG_INDEX_MAGIC "LOGIDX01"
+
+typedef struct local_log_index_header {
+  char magic[8];        /* LOCAL_LOG_INDEX_MAGIC */
+  uint32_t id_size;     /* bytes per particle id */
+  uint32_t epoch;       /* epoch num */
+  uint64_t num_entries; /* num of entries that follow */
+} local_log_index_header_t;
+
+class local_log {
+ public:
+  local_log();
+  ~local_log();
+
+  /* create a new log. return 0 on success, or -1 on errors */
+  int open(const char* dir, int rank, int log_id, size_t id_size,
+           size_t buf_size);
+
+  /* append a record. return 0 on success, or -1 on errors */
+  int append(const char* id, size_t id_len, const char* data, size_t data_len,
+             int epoch);
+
+  /* write out all buffered data and the index of the current epoch */
+  int epoch_flush();
+
+  /* flush and close the log */
+  int close();
+
+  /* total num of bytes written to the data log and all indexes */
+  uint64_t bytes_written() const { return bytes_written_; }
+  /* total num of files created */
+  uint64_t files_written() const { return files_written_; }
+
+ private:
+  int flush_buffer();
+  int write_index();
+
+  std::string prefix_;   /* common path prefix of our files */
+  int fd_;               /* data log */
+  char* buf_;            /* write buffer */
+  size_t buf_size_;      /* buffer capacity */
+  size_t buf_used_;      /* bytes currently buffered */
+  uint64_t off_;         /* data log offset of the next record */
+  size_t id_size_;       /* bytes per particle id */
+  size_t ent_size_;      /* bytes per index entry */
+  std::string entries_;  /* index entries of the current epoch */
+  int epoch_;            /* current epoch, or -1 if none */
+  uint64_t bytes_written_;
+  uint64_t files_written_;
+
+  /* no copying allowed */
+  local_log(const local_log&);
+  void operator=(const local_log&);
+};
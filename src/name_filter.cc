@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "name_filter.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pdlfs-common/xxhash.h>
+
+#include "common.h"
+
+namespace {
+/* odd constants used to derive the eight bit positions within a block */
+const uint32_t SALT[8] = {0x47b6137bU, 0x44974d91U, 0x8824ad5bU,
+                          0xa2b7289dU, 0x705495c7U, 0x2df1424bU,
+                          0x9efc4947U, 0x5c6bfb31U};
+}  // namespace
+
+name_filter::name_filter() : blks_(NULL), nblks_(0) {}
+
+name_filter::~name_filter() { free(blks_); }
+
+void name_filter::init(size_t size) {
+  nblks_ = size / sizeof(block);
+  if (nblks_ == 0) nblks_ = 1;
+  /* blocks are aligned so that no block straddles two cache lines */
+  if (posix_memalign(reinterpret_cast<void**>(&blks_), 64,
+                     nblks_ * sizeof(block)) != 0)
+    ABORT("posix_memalign");
+  clear();
+}
+
+void name_filter::clear() { memset(blks_, 0, nblks_ * sizeof(block)); }
+
+int name_filter::add(const char* name, size_t len) {
+  const uint64_t h = pdlfs::xxhash64(name, len, 0);
+  /* the upper half picks the block and the lower half picks the bits */
+  block* const b = &blks_[((h >> 32) * nblks_) >> 32];
+  const uint32_t key = static_cast<uint32_t>(h);
+  uint32_t mask[8];
+  int hit = 1;
+
+  for (int i = 0; i < 8; i++) {
+    mask[i] = 1U << ((key * SALT[i]) >> 27);
+    if ((b->w[i] & mask[i]) == 0) {
+      hit = 0;
+    }
+  }
+
+  /* skip the atomic ops if all the bits are already there */
+  if (!hit) {
+    for (int i = 0; i < 8; i++) {
+      if ((b->w[i] & mask[i]) == 0) {
+        __sync_fetch_and_or(&b->w[i], mask[i]);
+      }
+    }
+  }
+
+  return hit;
+}
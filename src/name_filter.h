@@ -0,0 +1,74 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * name_filter.h  memory-bounded detector for duplicate particle names.
+ *
+ * this is a split-block bloom filter: each name selects one 32-byte block
+ * and sets one bit in each of the block's eight 32-bit words, so a lookup
+ * touches a single cache line. names may be added by multiple threads
+ * concurrently without locking. a hit means the name has probably been
+ * seen before; false positives are possible but false negatives are not.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class name_filter {
+ public:
+  name_filter();
+  ~name_filter();
+
+  /* must be called once before use. size is in bytes */
+  void init(size_t size);
+
+  /* add a name. return 1 if the name was (probably) added before */
+  int add(const char* name, size_t len);
+
+  /* forget all names */
+  void clear();
+
+  /* memory used by the filter */
+  size_t size() const { return nblks_ * sizeof(block); }
+
+ private:
+  struct block {
+    uint32_t w[8];
+  };
+
+  block* blks_;
+  size_t nblks_;
+
+  /* no copying allowed */
+  name_filter(const name_filter&);
+  void operator=(const name_filter&);
+};
@@ -36,6 +36,7 @@
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "bin_trace.h"
 #include "common.h"
 #include "nn_shuffler.h"
 #include "nn_shuffler_internal.h"
@@ -309,7 +310,9 @@ void nn_shuffler_bgwait() {
   while (items_completed < items_submitted) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[wk_cv]);
-      if (pctx.trace != NULL) {
+      if (pctx.trace_bin) {
+        bin_trace_event(TRACE_DELIV_WAIT, -1, -1, -1, 0, delay);
+      } else if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[DELIV-WAIT] %d us\n", int(delay));
       }
       usleep(delay);
@@ -372,13 +375,14 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
   static char buf[MAX_RPC_MESSAGE];
 
   char* input;
+  const char* p;
   uint32_t input_left;
   hg_return_t hret;
   write_out_t write_out;
   write_in_t write_in;
   write_info_t write_info;
   char* req;
-  unsigned int req_sz;
+  uint32_t req_sz;
   int epoch;
   int src;
   int dst;
@@ -410,7 +414,9 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
 
   /* write trace if we are in testing mode */
   if (pctx.testin) {
-    if (pctx.trace != NULL) {
+    if (pctx.trace_bin) {
+      bin_trace_event(TRACE_RECV, src, dst, -1, 0, write_in.sz);
+    } else if (pctx.trace != NULL) {
       fprintf(pctx.trace, "[RECV] %u bytes r%d << r%d\n", write_in.sz, dst,
               src);
     }
@@ -423,12 +429,12 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
 
   /* decode and execute writes */
   while (input_left != 0) {
-    if (input_left < 1) {
+    p = shuffle_decode_varint(input, input + input_left, &req_sz);
+    if (p == NULL) {
       ABORT("premature end of msg");
     }
-    req_sz = static_cast<unsigned char>(input[0]);
-    input_left -= 1;
-    input += 1;
+    input_left -= p - input;
+    input += p - input;
     if (input_left < req_sz) {
       ABORT("premature end of msg");
     }
@@ -437,7 +443,13 @@ hg_return_t nn_shuffler_write_rpc_handler(hg_handle_t h, write_info_t* info) {
     input += req_sz;
 
     if (nnctx.paranoid_checks) {
-      target_rank = shuffle_target(nnctx.shctx, req, req_sz);
+      /* energy bins may differ from the sender's while they are being
+       * negotiated or refined, so only the receiver role can be checked */
+      if (shuffle_needs_bins(nnctx.shctx)) {
+        target_rank = shuffle_is_rank_receiver(nnctx.shctx, rank) ? rank : -1;
+      } else {
+        target_rank = shuffle_record_target(nnctx.shctx, req, req_sz, src);
+      }
       if (rank != target_rank) {
         nn_shuffler_debug(src, dst, rank, target_rank);
         ABORT("rpc msg misdirected");
@@ -545,7 +557,9 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
 
   /* write trace if we are in testing mode */
   if (pctx.testin) {
-    if (pctx.trace != NULL) {
+    if (pctx.trace_bin) {
+      bin_trace_event(TRACE_SEND, rank, peer_rank, -1, 0, write_in->sz);
+    } else if (pctx.trace != NULL) {
       fprintf(pctx.trace, "[SEND] %u bytes r%d >> r%d\n", write_in->sz, rank,
               peer_rank);
     }
@@ -558,7 +572,9 @@ int nn_shuffler_write_send_async(write_in_t* write_in, int peer_rank,
   while (cb_left == 0) { /* no slots available */
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
-      if (pctx.trace != NULL) {
+      if (pctx.trace_bin) {
+        bin_trace_event(TRACE_SEND_SLOT, -1, -1, -1, 0, delay);
+      } else if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[SEND-SLOT] %d us\n", int(delay));
       }
       usleep(delay);
@@ -637,7 +653,9 @@ void nn_shuffler_waitcb() {
   while (cb_left != cb_allowed) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[cb_cv]);
-      if (pctx.trace != NULL) {
+      if (pctx.trace_bin) {
+        bin_trace_event(TRACE_REPLY_WAIT, -1, -1, -1, 0, delay);
+      } else if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[REPLY-WAIT] %d us\n", int(delay));
       }
 
@@ -703,7 +721,9 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   assert(write_in->src == rank);
 
   if (pctx.testin) {
-    if (pctx.trace != NULL) {
+    if (pctx.trace_bin) {
+      bin_trace_event(TRACE_SEND, rank, peer_rank, -1, 0, write_in->sz);
+    } else if (pctx.trace != NULL) {
       fprintf(pctx.trace, "[SEND] %u bytes r%d >> r%d\n", write_in->sz, rank,
               peer_rank);
     }
@@ -733,7 +753,9 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
   while (write_cb.ok == 0) { /* rpc not completed */
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[rpc_cv]);
-      if (pctx.trace != NULL) {
+      if (pctx.trace_bin) {
+        bin_trace_event(TRACE_REPLY_WAIT, rank, peer_rank, -1, 0, delay);
+      } else if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[REPLY-WAIT] r%d >> r%d %d us\n", rank, peer_rank,
                 int(delay));
       }
@@ -776,7 +798,7 @@ int nn_shuffler_write_send(write_in_t* write_in, int peer_rank) {
 
 /* nn_shuffler_enqueue:
  *   encode a req and append it into a corresponding rpc queue */
-void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
+void nn_shuffler_enqueue(char* req, unsigned int req_sz, int epoch,
                          int peer_rank, int rank) {
   write_in_t write_in;
   rpcq_t* rpcq;
@@ -788,11 +810,13 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
   int rv;
   void* arg1;
   void* arg2;
+  size_t hdr_sz;
   int e;
 
   assert(nnctx.mssg != NULL);
   assert(rank == mssg_get_rank(nnctx.mssg));
   world_sz = mssg_get_count(nnctx.mssg);
+  hdr_sz = shuffle_varint_length(req_sz);
 
   if (nnctx.paranoid_checks) {
     if (!shuffle_is_rank_receiver(nnctx.shctx, peer_rank)) {
@@ -817,7 +841,9 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
   while (rpcq->busy != 0) {
     if (pctx.testin) {
       pthread_mtx_unlock(&mtx[qu_cv]);
-      if (pctx.trace != NULL) {
+      if (pctx.trace_bin) {
+        bin_trace_event(TRACE_ENQUEUE_WAIT, -1, -1, -1, 0, delay);
+      } else if (pctx.trace != NULL) {
         fprintf(pctx.trace, "[ENQUEUE-WAIT] %d us\n", int(delay));
       }
 
@@ -839,7 +865,7 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
   }
 
   /* flush queue if full */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
+  if (rpcq->sz + hdr_sz + req_sz > max_rpcq_sz) {
     if (rpcq->sz > MAX_RPC_MESSAGE) {
       /* happens when the total size of queued data is greater than
        * the size limit for an rpc message */
@@ -873,15 +899,14 @@ void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
   }
 
   /* enqueue */
-  if (rpcq->sz + req_sz + 1 > max_rpcq_sz) {
+  if (rpcq->sz + hdr_sz + req_sz > max_rpcq_sz) {
     /* happens when the memory reserved for the queue is smaller than
      * a single write */
     ABORT("rpc overflow");
   } else {
     rpcq->lepo = epoch;
-    rpcq->buf[rpcq->sz] = req_sz;
-    memcpy(rpcq->buf + rpcq->sz + 1, req, req_sz);
-    rpcq->sz += req_sz + 1;
+    memcpy(shuffle_encode_varint(rpcq->buf + rpcq->sz, req_sz), req, req_sz);
+    rpcq->sz += hdr_sz + req_sz;
   }
 
   pthread_mtx_unlock(&mtx[qu_cv]);
@@ -1097,6 +1122,7 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
   pthread_t pid;
   char msg[200];
   const char* env;
+  size_t rec_sz;
   int nbufs;
   int rv;
   int i;
@@ -1238,6 +1264,19 @@ void nn_shuffler_init(shuffle_ctx_t* ctx) {
     }
   }
 
+  /* each queue must hold at least one write */
+  rec_sz = SHUFFLE_MAX_VARINT_LEN + ctx->fname_len + 1 + ctx->data_len +
+           ctx->extra_data_len;
+  if (max_rpcq_sz < rec_sz) {
+    if (rec_sz > MAX_RPC_MESSAGE) {
+      ABORT("particle too large for an rpc message");
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_WARN, "RPC BUFFER SIZE RAISED TO FIT A PARTICLE");
+    }
+    max_rpcq_sz = rec_sz;
+  }
+
   nbufs = 0; /* number sender buffers we actually allocated */
 
   rpcqs = static_cast<rpcq_t*>(malloc(nrpcqs * sizeof(rpcq_t)));
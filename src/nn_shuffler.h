@@ -85,7 +85,7 @@ extern int nn_shuffler_world_size();
 extern int nn_shuffler_my_rank();
 
 /* nn_shuffler_enqueue: put an incoming write into an rpc queue. */
-extern void nn_shuffler_enqueue(char* req, unsigned char req_sz, int epoch,
+extern void nn_shuffler_enqueue(char* req, unsigned int req_sz, int epoch,
                                 int peer_rank, int rank);
 
 /* nn_shuffler_waitcb: wait for all outstanding rpcs to finish. */
@@ -160,6 +160,22 @@ extern void nn_shuffler_wakeup();
  */
 #define DEFAULT_VIRTUAL_FACTOR 1024
 
+/*
+ * Default number of buckets (log2) in a precomputed placement table.
+ *
+ * The table is grown from DEFAULT_PLACEMENT_TABLE_BITS until each rank
+ * gets at least DEFAULT_PLACEMENT_TABLE_BUCKETS_PER_RANK buckets, but not
+ * past DEFAULT_PLACEMENT_TABLE_MAX_BITS: 64K buckets take 256KB and 1M
+ * buckets take 4MB, which still fit in cache. Larger tables, up to
+ * MAX_PLACEMENT_TABLE_BITS (16M buckets, 64MB), are opt-in. Fewer than
+ * MIN_PLACEMENT_TABLE_BUCKETS_PER_RANK buckets per rank trigger a warning.
+ */
+#define DEFAULT_PLACEMENT_TABLE_BITS 16
+#define DEFAULT_PLACEMENT_TABLE_MAX_BITS 20
+#define DEFAULT_PLACEMENT_TABLE_BUCKETS_PER_RANK 1024
+#define MIN_PLACEMENT_TABLE_BUCKETS_PER_RANK 64
+#define MAX_PLACEMENT_TABLE_BITS 24
+
 /*
  * The default subnet.
  *
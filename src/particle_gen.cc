@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "particle_gen.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "common.h"
+
+/* default generator settings */
+#define DEFAULT_UTH 0.1
+#define DEFAULT_TAIL_FRAC 0.01
+#define DEFAULT_TAIL_INDEX 3.0
+#define DEFAULT_SKEW 0.5
+
+namespace {
+/* splitmix64: a tiny counter-based random number generator */
+inline uint64_t mix64(uint64_t x) {
+  x += 0x9e3779b97f4a7c15ULL;
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+struct rng {
+  uint64_t s;
+  explicit rng(uint64_t seed) : s(seed) {}
+  /* uniform in (0, 1) */
+  double uniform() { return (double(mix64(s++) >> 11) + 0.5) / 9007199254740992.0; }
+  /* standard normal via box-muller */
+  double normal() {
+    const double u1 = uniform();
+    const double u2 = uniform();
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+  }
+};
+
+double getenv_double(const char* name, double def) {
+  const char* tmp = maybe_getenv(name);
+  if (tmp == NULL || tmp[0] == 0) return def;
+  return atof(tmp);
+}
+}  // namespace
+
+void pgen_init(particle_gen_t* gen, const particle_schema_t* schema) {
+  static const char* const names[PGEN_NUM_FIELDS] = {
+      "time", "dx", "dy", "dz", "voxel", "ux", "uy", "uz", "w", "tag"};
+  const char* tmp;
+
+  memset(gen, 0, sizeof(*gen));
+  gen->schema = schema;
+  for (int i = 0; i < PGEN_NUM_FIELDS; i++) {
+    gen->fields[i] = pschema_find(schema, names[i]);
+  }
+  gen->dist = PGEN_MAXWELLIAN;
+  tmp = maybe_getenv("PRELOAD_Fake_data_dist");
+  if (tmp != NULL) {
+    if (strcmp(tmp, "powerlaw") == 0) {
+      gen->dist = PGEN_POWERLAW;
+    } else if (strcmp(tmp, "skew") == 0) {
+      gen->dist = PGEN_SKEW;
+    } else if (strcmp(tmp, "maxwellian") != 0) {
+      ABORT("bad fake data dist");
+    }
+  }
+
+  gen->uth = getenv_double("PRELOAD_Fake_data_uth", DEFAULT_UTH);
+  gen->tail_frac =
+      getenv_double("PRELOAD_Fake_data_tail_frac", DEFAULT_TAIL_FRAC);
+  gen->tail_index =
+      getenv_double("PRELOAD_Fake_data_tail_index", DEFAULT_TAIL_INDEX);
+  gen->skew = getenv_double("PRELOAD_Fake_data_skew", DEFAULT_SKEW);
+  if (gen->uth <= 0 || gen->tail_frac < 0 || gen->tail_frac > 1 ||
+      gen->tail_index <= 1) {
+    ABORT("bad fake data params");
+  }
+}
+
+void pgen_epoch(particle_gen_t* gen, int rank, int epoch) {
+  gen->rank = rank;
+  gen->epoch = epoch;
+  gen->seq = 0;
+}
+
+void pgen_fill(particle_gen_t* gen, char* buf, size_t sz) {
+  const uint64_t seq = __sync_fetch_and_add(&gen->seq, 1);
+  /* each particle has its own stream, so multiple threads may generate
+   * particles concurrently */
+  rng r(mix64(mix64((uint64_t(gen->rank) << 32) | uint32_t(gen->epoch)) ^
+              mix64(seq)));
+  double f[PGEN_NUM_FIELDS];
+  double u[3];
+
+  f[0] = gen->epoch;
+  f[1] = 2.0 * r.uniform() - 1.0;
+  f[2] = 2.0 * r.uniform() - 1.0;
+  f[3] = 2.0 * r.uniform() - 1.0;
+  f[4] = double(mix64(r.s++) & ((1u << 20) - 1));
+
+  for (int i = 0; i < 3; i++) {
+    u[i] = gen->uth * r.normal();
+  }
+
+  if (gen->dist != PGEN_MAXWELLIAN && r.uniform() < gen->tail_frac) {
+    if (gen->dist == PGEN_POWERLAW) {
+      /* inverse cdf of p(u) ~ u^-k for u >= u0 */
+      const double u0 = 3.0 * gen->uth;
+      const double mag =
+          u0 * pow(r.uniform(), -1.0 / (gen->tail_index - 1.0));
+      const double cost = 2.0 * r.uniform() - 1.0;
+      const double sint = sqrt(1.0 - cost * cost);
+      const double phi = 2.0 * M_PI * r.uniform();
+      u[0] = mag * sint * cos(phi);
+      u[1] = mag * sint * sin(phi);
+      u[2] = mag * cost;
+    } else {
+      u[0] += gen->skew * gen->uth * gen->epoch;
+    }
+  }
+
+  f[5] = u[0];
+  f[6] = u[1];
+  f[7] = u[2];
+  f[8] = 1.0;
+  f[9] = double(seq);
+
+  memset(buf, 0, sz);
+  for (int i = 0; i < PGEN_NUM_FIELDS; i++) {
+    const int idx = gen->fields[i];
+    if (idx != -1 && size_t(gen->schema->fields[idx].offset +
+                            gen->schema->fields[idx].size) <= sz) {
+      pschema_set(gen->schema, idx, buf, f[i]);
+    }
+  }
+}
+
+const char* pgen_dist_name(int dist) {
+  switch (dist) {
+    case PGEN_POWERLAW:
+      return "powerlaw";
+    case PGEN_SKEW:
+      return "skew";
+    default:
+      return "maxwellian";
+  }
+}
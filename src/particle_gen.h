@@ -0,0 +1,91 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * particle_gen.h  synthetic vpic particles for PRELOAD_Inject_fake_data.
+ *
+ * particles are laid out according to a particle schema. the generator
+ * sets the following fields when the schema has them, and zeros the rest:
+ *
+ *   time (epoch num), dx, dy, dz, voxel (index), ux, uy, uz, w (weight),
+ *   and tag
+ *
+ * momenta are drawn from one of the following distributions:
+ *
+ *   maxwellian: each component is normal with std dev uth
+ *   powerlaw: maxwellian, except that a tail_frac fraction of particles
+ *     get isotropic momenta with magnitudes following a power law of
+ *     index tail_index above 3 * uth
+ *   skew: maxwellian, except that a tail_frac fraction of particles form
+ *     a beam along x whose drift is skew * uth * epoch, so the energy
+ *     distribution changes from one epoch to the next
+ *
+ * particles are generated deterministically from the rank, the epoch, and
+ * the particle's sequence number within the epoch.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "particle_schema.h"
+
+#define PGEN_MAXWELLIAN 0
+#define PGEN_POWERLAW 1
+#define PGEN_SKEW 2
+
+typedef struct particle_gen {
+  int dist;          /* PGEN_XXX */
+  double uth;        /* thermal momentum spread */
+  double tail_frac;  /* fraction of particles in the tail or beam */
+  double tail_index; /* power-law index of the tail */
+  double skew;       /* beam drift added per epoch (in uth) */
+
+  const particle_schema_t* schema;
+#define PGEN_NUM_FIELDS 10
+  int fields[PGEN_NUM_FIELDS]; /* schema index of each generated field */
+
+  int rank;
+  int epoch;
+  uint64_t seq; /* num of particles generated in this epoch */
+} particle_gen_t;
+
+/* init a generator from PRELOAD_Fake_data_xxx env vars */
+extern void pgen_init(particle_gen_t* gen, const particle_schema_t* schema);
+
+/* start a new epoch */
+extern void pgen_epoch(particle_gen_t* gen, int rank, int epoch);
+
+/* generate a particle into buf. fields not fitting in sz are dropped */
+extern void pgen_fill(particle_gen_t* gen, char* buf, size_t sz);
+
+/* return the name of a distribution */
+extern const char* pgen_dist_name(int dist);
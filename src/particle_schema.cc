@@ -0,0 +1,186 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "particle_schema.h"
+
+#include <assert.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "common.h"
+
+#define VPIC_SCHEMA                                                         \
+  "time:f32,dx:f32,dy:f32,dz:f32,voxel:i32,ux:f32,uy:f32,uz:f32,w:f32,tag:" \
+  "f32"
+
+namespace {
+const char* const type_names[] = {"f32", "f64", "i32", "i64", "u32", "u64"};
+
+int host_is_le() {
+  const uint16_t one = 1;
+  char c;
+  memcpy(&c, &one, 1);
+  return c == 1;
+}
+
+/* parse a single name:type[:offset][:le|be] field */
+int parse_field(particle_field_t* fld, char* str, int next_off) {
+  char* save = NULL;
+  char* tok = strtok_r(str, ":", &save);
+  if (tok == NULL || strlen(tok) > PSCHEMA_MAX_NAME) return -1;
+  strcpy(fld->name, tok);
+  tok = strtok_r(NULL, ":", &save);
+  if (tok == NULL) return -1;
+  fld->type = -1;
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(tok, type_names[i]) == 0) {
+      fld->type = i;
+      break;
+    }
+  }
+  if (fld->type == -1) return -1;
+  fld->size = (fld->type == PSCHEMA_F64 || fld->type == PSCHEMA_I64 ||
+               fld->type == PSCHEMA_U64)
+                  ? 8
+                  : 4;
+  fld->offset = next_off;
+  fld->swap = 0;
+  while ((tok = strtok_r(NULL, ":", &save)) != NULL) {
+    if (isdigit(static_cast<unsigned char>(tok[0]))) {
+      fld->offset = atoi(tok);
+    } else if (strcmp(tok, "le") == 0) {
+      fld->swap = !host_is_le();
+    } else if (strcmp(tok, "be") == 0) {
+      fld->swap = host_is_le();
+    } else {
+      return -1;
+    }
+  }
+  return 0;
+}
+}  // namespace
+
+int pschema_parse(particle_schema_t* s, const char* spec) {
+  std::string str;
+  /* strip comments and whitespace */
+  for (const char* p = spec; *p != 0; p++) {
+    if (*p == '#') {
+      while (p[1] != 0 && p[1] != '\n') p++;
+    } else if (*p == '\n' || *p == ';') {
+      str.push_back(',');
+    } else if (!isspace(*p)) {
+      str.push_back(*p);
+    }
+  }
+
+  memset(s, 0, sizeof(*s));
+  char* save = NULL;
+  int off = 0;
+  for (char* tok = strtok_r(&str[0], ",", &save); tok != NULL;
+       tok = strtok_r(NULL, ",", &save)) {
+    if (s->num_fields == PSCHEMA_MAX_FIELDS) return -1;
+    particle_field_t* const fld = &s->fields[s->num_fields];
+    if (parse_field(fld, tok, off) != 0) return -1;
+    if (pschema_find(s, fld->name) != -1) return -1; /* dup */
+    s->num_fields++;
+    off = fld->offset + fld->size;
+    if (off > s->size) {
+      s->size = off;
+    }
+  }
+  if (s->num_fields == 0) return -1;
+
+  s->dx = pschema_find(s, "dx");
+  s->dy = pschema_find(s, "dy");
+  s->dz = pschema_find(s, "dz");
+  s->voxel = pschema_find(s, "voxel");
+  s->ux = pschema_find(s, "ux");
+  s->uy = pschema_find(s, "uy");
+  s->uz = pschema_find(s, "uz");
+
+  return 0;
+}
+
+void pschema_default(particle_schema_t* s) {
+  int rv = pschema_parse(s, VPIC_SCHEMA);
+  assert(rv == 0);
+  (void)rv;
+}
+
+void pschema_init(particle_schema_t* s) {
+  const char* spec = maybe_getenv("PRELOAD_Particle_schema");
+  const char* fname = maybe_getenv("PRELOAD_Particle_schema_file");
+  std::string buf;
+
+  if (spec == NULL && fname != NULL) {
+    /* runs inside preload_init(), so avoid our own stdio wrappers */
+    int fd = open(fname, O_RDONLY);
+    if (fd == -1) {
+      ABORT("cannot open particle schema file");
+    }
+    char tmp[256];
+    ssize_t n;
+    while ((n = read(fd, tmp, sizeof(tmp))) > 0) {
+      buf.append(tmp, n);
+    }
+    close(fd);
+    spec = buf.c_str();
+  }
+
+  if (spec == NULL) {
+    pschema_default(s);
+  } else if (pschema_parse(s, spec) != 0) {
+    ABORT("bad particle schema");
+  }
+}
+
+int pschema_find(const particle_schema_t* s, const char* name) {
+  for (int i = 0; i < s->num_fields; i++) {
+    if (strcmp(s->fields[i].name, name) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+std::string pschema_str(const particle_schema_t* s) {
+  std::string rv;
+  char tmp[64];
+  for (int i = 0; i < s->num_fields; i++) {
+    const particle_field_t* const fld = &s->fields[i];
+    snprintf(tmp, sizeof(tmp), "%s%s:%s:%d%s", i != 0 ? "," : "", fld->name,
+             type_names[fld->type], fld->offset,
+             fld->swap ? (host_is_le() ? ":be" : ":le") : "");
+    rv += tmp;
+  }
+  return rv;
+}
@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * particle_schema.h  describe the layout of a particle record.
+ *
+ * a schema is a list of fields, each with a name, a type, a byte offset,
+ * and a byte order. it is given as a string of comma (or newline)
+ * separated fields:
+ *
+ *   name:type[:offset][:le|be]
+ *
+ * where type is one of f32, f64, i32, i64, u32, and u64. offsets default
+ * to the end of the previous field and byte order defaults to the host's.
+ * text after a '#' is ignored so that a schema may be kept in a file.
+ *
+ * the default schema is the vpic particle layout:
+ *
+ *   time:f32, dx:f32, dy:f32, dz:f32, voxel:i32, ux:f32, uy:f32, uz:f32,
+ *   w:f32, tag:f32
+ *
+ * fields named dx, dy, dz, voxel, ux, uy, and uz are looked up once when a
+ * schema is loaded, so the energy and partitioning code can read them by
+ * index. fields are read in place from the particle buffer; a field
+ * missing from the schema has index -1. extra padding appended to a
+ * particle (PRELOAD_Particle_extra_size) is never part of the schema.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <string>
+
+#define PSCHEMA_F32 0
+#define PSCHEMA_F64 1
+#define PSCHEMA_I32 2
+#define PSCHEMA_I64 3
+#define PSCHEMA_U32 4
+#define PSCHEMA_U64 5
+
+#define PSCHEMA_MAX_FIELDS 32
+#define PSCHEMA_MAX_NAME 15
+
+typedef struct particle_field {
+  char name[PSCHEMA_MAX_NAME + 1];
+  int type;   /* PSCHEMA_XXX */
+  int offset; /* byte offset within a particle */
+  int size;   /* 4 or 8 */
+  int swap;   /* stored in the opposite byte order of the host */
+} particle_field_t;
+
+typedef struct particle_schema {
+  particle_field_t fields[PSCHEMA_MAX_FIELDS];
+  int num_fields;
+  int size; /* min particle size to hold all fields */
+
+  /* well-known fields (-1 if missing) */
+  int dx, dy, dz; /* position within the voxel */
+  int voxel;      /* voxel index */
+  int ux, uy, uz; /* momentum */
+} particle_schema_t;
+
+/* parse a schema from a string. return 0 on success, or -1 on errors */
+extern int pschema_parse(particle_schema_t* s, const char* spec);
+
+/* load the vpic default schema */
+extern void pschema_default(particle_schema_t* s);
+
+/* load a schema from PRELOAD_Particle_schema or PRELOAD_Particle_schema_file,
+ * falling back to the vpic default. abort on errors */
+extern void pschema_init(particle_schema_t* s);
+
+/* return the index of a named field, or -1 if there is no such field */
+extern int pschema_find(const particle_schema_t* s, const char* name);
+
+/* print a schema back into its string form */
+extern std::string pschema_str(const particle_schema_t* s);
+
+/* read field f of a particle as a double */
+inline double pschema_get(const particle_schema_t* s, int f,
+                          const char* data) {
+  const particle_field_t* const fld = &s->fields[f];
+  const char* const p = data + fld->offset;
+  if (fld->size == 4) {
+    uint32_t u;
+    memcpy(&u, p, 4);
+    if (fld->swap) u = __builtin_bswap32(u);
+    switch (fld->type) {
+      case PSCHEMA_F32: {
+        float v;
+        memcpy(&v, &u, 4);
+        return v;
+      }
+      case PSCHEMA_I32:
+        return double(int32_t(u));
+      default:
+        return double(u);
+    }
+  } else {
+    uint64_t u;
+    memcpy(&u, p, 8);
+    if (fld->swap) u = __builtin_bswap64(u);
+    switch (fld->type) {
+      case PSCHEMA_F64: {
+        double v;
+        memcpy(&v, &u, 8);
+        return v;
+      }
+      case PSCHEMA_I64:
+        return double(int64_t(u));
+      default:
+        return double(u);
+    }
+  }
+}
+
+/* read field f of a particle as an integer */
+inline int64_t pschema_get_int(const particle_schema_t* s, int f,
+                               const char* data) {
+  const particle_field_t* const fld = &s->fields[f];
+  if (fld->type == PSCHEMA_F32 || fld->type == PSCHEMA_F64) {
+    return int64_t(pschema_get(s, f, data));
+  }
+  const char* const p = data + fld->offset;
+  if (fld->size == 4) {
+    uint32_t u;
+    memcpy(&u, p, 4);
+    if (fld->swap) u = __builtin_bswap32(u);
+    return (fld->type == PSCHEMA_I32) ? int64_t(int32_t(u)) : int64_t(u);
+  } else {
+    uint64_t u;
+    memcpy(&u, p, 8);
+    if (fld->swap) u = __builtin_bswap64(u);
+    return int64_t(u);
+  }
+}
+
+/* write field f of a particle */
+inline void pschema_set(const particle_schema_t* s, int f, char* data,
+                        double v) {
+  const particle_field_t* const fld = &s->fields[f];
+  char* const p = data + fld->offset;
+  if (fld->size == 4) {
+    uint32_t u;
+    if (fld->type == PSCHEMA_F32) {
+      const float x = float(v);
+      memcpy(&u, &x, 4);
+    } else if (fld->type == PSCHEMA_I32) {
+      u = uint32_t(int32_t(v));
+    } else {
+      u = uint32_t(v);
+    }
+    if (fld->swap) u = __builtin_bswap32(u);
+    memcpy(p, &u, 4);
+  } else {
+    uint64_t u;
+    if (fld->type == PSCHEMA_F64) {
+      memcpy(&u, &v, 8);
+    } else if (fld->type == PSCHEMA_I64) {
+      u = uint64_t(int64_t(v));
+    } else {
+      u = uint64_t(v);
+    }
+    if (fld->swap) u = __builtin_bswap64(u);
+    memcpy(p, &u, 8);
+  }
+}
+
+/* return non-zero if the schema has all momentum fields */
+inline int pschema_has_momentum(const particle_schema_t* s) {
+  return s->ux >= 0 && s->uy >= 0 && s->uz >= 0;
+}
+
+/* return non-zero if the schema has all position fields */
+inline int pschema_has_position(const particle_schema_t* s) {
+  return s->voxel >= 0 && s->dx >= 0 && s->dy >= 0 && s->dz >= 0;
+}
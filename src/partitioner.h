@@ -0,0 +1,153 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * partitioner.h  policies that pick the shuffle destination of a particle.
+ *
+ * each policy is a struct with a static target() that shuffle_write() is
+ * instantiated with, so the policy is inlined into the write path and the
+ * choice among policies is made once per write rather than per field.
+ * target() also gets the rank that wrote the particle so that receivers
+ * can recompute the sender's choice.
+ *
+ *   hash: xxhash of the particle name through the placement protocol
+ *   energy: particle energy ranges, as given by ctx->dest_bins
+ *   spatial<axis>: equal-width ranges of the particle's x, y, or z position
+ *   zorder: equal-width ranges of the morton code of (x, y, z)
+ *
+ * particle fields are located through pctx.pschema. dx, dy, and dz are
+ * offsets within the voxel in [-1, 1]. voxel indexes are x-major over a
+ * grid of pgrid[0] * pgrid[1] * pgrid[2] voxels (ghosts included).
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+
+#include "preload_internal.h"
+#include "preload_shuffle.h"
+
+#include "loadbalance_util.h"
+
+namespace partitioner {
+
+/* coordinate of a rank's subdomain along the given axis of the pdomain grid */
+inline int origin(const shuffle_ctx_t* ctx, int rank, int axis) {
+  if (axis >= 1) rank /= ctx->pdomain[0];
+  if (axis >= 2) rank /= ctx->pdomain[1];
+  return rank % ctx->pdomain[axis];
+}
+
+/* particle position normalized to [0, 1) along the given axis of the global
+ * domain. the voxel index is local to the subdomain of src, the rank the
+ * particle was written at, and is offset by that subdomain's origin. */
+inline double position(const shuffle_ctx_t* ctx, const char* data, int axis,
+                       int src) {
+  const particle_schema_t* const s = &pctx.pschema;
+  int64_t i = pschema_get_int(s, s->voxel, data);
+  if (axis >= 1) i /= ctx->pgrid[0];
+  if (axis >= 2) i /= ctx->pgrid[1];
+  i %= ctx->pgrid[axis];
+  const int off = (axis == 0) ? s->dx : (axis == 1) ? s->dy : s->dz;
+  double x = (double(i) + (pschema_get(s, off, data) + 1.0) / 2.0) /
+             ctx->pgrid[axis];
+  x = (origin(ctx, src, axis) + x) / ctx->pdomain[axis];
+  if (!(x >= 0)) x = 0; /* also catches nan */
+  if (x >= 1) x = 0.999999999;
+  return x;
+}
+
+/* map x in [0, 1) to one of n equal-width ranges */
+inline int range(double x, int n) {
+  int rv = static_cast<int>(x * n);
+  return (rv < n) ? rv : n - 1;
+}
+
+/* spread the low 21 bits of v so that there are two 0 bits between each */
+inline uint64_t spread3(uint64_t v) {
+  v &= 0x1fffff;
+  v = (v | (v << 32)) & 0x1f00000000ffffULL;
+  v = (v | (v << 16)) & 0x1f0000ff0000ffULL;
+  v = (v | (v << 8)) & 0x100f00f00f00f00fULL;
+  v = (v | (v << 4)) & 0x10c30c30c30c30c3ULL;
+  v = (v | (v << 2)) & 0x1249249249249249ULL;
+  return v;
+}
+
+struct hash {
+  static int target(shuffle_ctx_t* ctx, const char* fname, const char* data,
+                    int src) {
+    return shuffle_target(ctx, const_cast<char*>(fname), ctx->fname_len);
+  }
+};
+
+struct energy {
+  /* energies outside all bins go to the closest one */
+  static int clamp(int rv, int n) {
+    if (rv < 0) rv = 0;
+    if (rv >= n) rv = n - 1;
+    return rv;
+  }
+  static int bin(shuffle_ctx_t* ctx, double e) {
+    const int n = pctx.comm_sz;
+    return shuffle_receiver(ctx, clamp(binary_search(ctx->dest_bins, n, e), n));
+  }
+  static int target(shuffle_ctx_t* ctx, const char* fname, const char* data,
+                    int src) {
+    return bin(ctx, compute_energy(data));
+  }
+};
+
+template <int axis>
+struct spatial {
+  static int target(shuffle_ctx_t* ctx, const char* fname, const char* data,
+                    int src) {
+    const int n = shuffle_world_sz(ctx);
+    return shuffle_receiver(ctx, range(position(ctx, data, axis, src), n));
+  }
+};
+
+struct zorder {
+  static int target(shuffle_ctx_t* ctx, const char* fname, const char* data,
+                    int src) {
+    const double scale = double(1 << 21);
+    uint64_t code = 0;
+    for (int axis = 0; axis < 3; axis++) {
+      const uint64_t q = uint64_t(position(ctx, data, axis, src) * scale);
+      code |= spread3(q) << (2 - axis);
+    }
+    const int n = shuffle_world_sz(ctx);
+    return shuffle_receiver(ctx,
+                            range(double(code) / double(uint64_t(1) << 63), n));
+  }
+};
+
+}  // namespace partitioner
@@ -79,6 +79,11 @@ int main(int argc, char** argv) {
 
   MPI_Finalize();
 
+  /*
+   * with deltafs bypassed particles are stored in append-only logs under
+   * the plfsdir. each log comes with a per-epoch index that maps particle
+   * ids to log offsets.
+   */
   char rname[PATH_MAX];
   const char* lo = getenv("PRELOAD_Local_root");
   if (lo == NULL) {
@@ -87,23 +92,75 @@ int main(int argc, char** argv) {
   if (rank == 0) {
     fprintf(stderr, "local_root is %s\n", lo);
   }
-  for (int i = 0; i < 10; i++) {
-    snprintf(rname, sizeof(rname), "%s/%05x-%05x", lo, rank, i);
+  snprintf(dname, sizeof(dname), "%s/%s", lo, mntp);
+  d = opendir(dname);
+  if (d == NULL) {
+    ABORT("opendir");
+  }
+  int found = 0;
+  struct dirent* dent;
+  while ((dent = readdir(d)) != NULL) {
+    if (strncmp(dent->d_name, "INDEX-", 6) != 0) {
+      continue;
+    }
+    snprintf(rname, sizeof(rname), "%s/%s", dname, dent->d_name);
     int fd = open(rname, O_RDONLY);
     if (fd == -1) {
       ABORT("open");
     }
-    char buf[32];
-    ssize_t nr = read(fd, buf, 32);
-    if (nr != 32) {
+    /* magic[8], id_size (u32), epoch (u32), num_entries (u64) */
+    char hdr[24];
+    if (read(fd, hdr, sizeof(hdr)) != sizeof(hdr)) {
       ABORT("read");
     }
-    int cmp = memcmp(buf, "1234567890abcdefghijklmnopqrstuv", 32);
-    if (cmp != 0) {
-      ABORT("data lost");
+    if (memcmp(hdr, "LOGIDX01", 8) != 0) {
+      ABORT("bad index");
     }
+    unsigned int id_size;
+    unsigned long long num_entries;
+    memcpy(&id_size, hdr + 8, 4);
+    memcpy(&num_entries, hdr + 16, 8);
+    if (id_size != 11) {
+      ABORT("bad id size");
+    }
+    /* DATA-<rank>-<log>.dat holds the data indexed by
+     * INDEX-<rank>-<log>-<epoch>.idx */
+    snprintf(rname, sizeof(rname), "%s/DATA-%.11s.dat", dname,
+             dent->d_name + 6);
+    int dfd = open(rname, O_RDONLY);
+    if (dfd == -1) {
+      ABORT("open");
+    }
+    for (unsigned long long j = 0; j < num_entries; j++) {
+      char ent[11 + 8 + 4];
+      if (read(fd, ent, sizeof(ent)) != sizeof(ent)) {
+        ABORT("read");
+      }
+      char myid[12];
+      snprintf(myid, sizeof(myid), "%05x-", rank);
+      if (memcmp(ent, myid, 6) != 0) {
+        continue;
+      }
+      unsigned long long off;
+      memcpy(&off, ent + 11, 8);
+      char buf[32];
+      ssize_t nr = pread(dfd, buf, 32, off);
+      if (nr != 32) {
+        ABORT("read");
+      }
+      int cmp = memcmp(buf, "1234567890abcdefghijklmnopqrstuv", 32);
+      if (cmp != 0) {
+        ABORT("data lost");
+      }
+      found++;
+    }
+    close(dfd);
     close(fd);
   }
+  closedir(d);
+  if (found != 10) {
+    ABORT("data lost");
+  }
 
   exit(0);
 }
@@ -45,10 +45,17 @@
 #include <string>
 #include <vector>
 
+#include "bin_trace.h"
+#include "local_log.h"
+#include "name_filter.h"
+#include "particle_gen.h"
 #include "preload_internal.h"
 #include "pthreadtap.h"
+#include "sample_table.h"
 #include "shuffler_udf.h"
 
+#include <pdlfs-common/xxhash.h>
+
 #ifdef PRELOAD_HAS_PAPI
 #include <papi.h>
 #endif
@@ -58,10 +65,17 @@
 #define DEFAULT_PARTICLE_EXTRA_BYTES 0
 #define DEFAULT_PARTICLE_BYTES 40
 #define DEFAULT_PARTICLE_BUFSIZE (2 << 20)
+#define DEFAULT_TRACE_RING_SIZE 65536
 
 /* default number of millisecs to wait for MPI async ops */
 #define DEFAULT_MPI_WAIT 50
 
+/* default number of microsecs to spin before a barrier backs off */
+#define DEFAULT_BARRIER_SPIN 200
+
+/* default number of preallocated plfsdir files per thread */
+#define DEFAULT_FAKE_FILE_POOL_SIZE 16
+
 /* mon output */
 static int mon_dump_bin = 0;
 static int mon_dump_txt = 1;
@@ -69,8 +83,267 @@ static int mon_dump_txt = 1;
 /* mutex to protect preload state */
 static pthread_mutex_t preload_mtx = PTHREAD_MUTEX_INITIALIZER;
 
-/* mutex to synchronize writes */
-static pthread_mutex_t write_mtx = PTHREAD_MUTEX_INITIALIZER;
+/*
+ * write_lane: writes are spread over a power-of-2 number of lanes keyed by
+ * the xxhash32 of particle names, the same hash plfsdir uses to pick its
+ * memtable partitions. by default there is one lane per partition so that
+ * writes to different partitions do not serialize on our side. each lane
+ * owns the sampling state for the names that map to it.
+ */
+namespace {
+struct write_lane {
+  pthread_mutex_t mtx;  /* serializes writes within the lane */
+  sample_table smpls; /* sampled particle names */
+  local_log* llog;    /* where writes go when deltafs is bypassed */
+};
+}  // namespace
+
+static write_lane* lanes = NULL;
+static int num_lanes = 0; /* always a power of 2 */
+
+/*
+ * flush_local_logs: flush the current epoch of all local logs.
+ */
+static void flush_local_logs() {
+  for (int i = 0; i < num_lanes; i++) {
+    if (lanes[i].llog != NULL) {
+      pthread_mtx_lock(&lanes[i].mtx);
+      if (lanes[i].llog->epoch_flush() != 0) {
+        ABORT("fail to flush local log");
+      }
+      pthread_mtx_unlock(&lanes[i].mtx);
+    }
+  }
+}
+
+/*
+ * pre_flush_epoch: soft flush an epoch at the end of it so that its data
+ * is written out while the app computes.
+ */
+static void pre_flush_epoch(int epoch) {
+  uint64_t flush_start;
+  uint64_t flush_end;
+
+  if (IS_BYPASS_WRITE(pctx.mode)) {
+    /* noop */
+
+  } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+    if (pctx.plfshdl != NULL) {
+      if (pctx.my_rank == 0) {
+        flush_start = now_micros();
+        logf(LOG_INFO, "pre-flushing plfsdir ... (rank 0)");
+      }
+
+      if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
+        ABORT("fail to flush plfsdir side io");
+      if (deltafs_plfsdir_flush(pctx.plfshdl, epoch) != 0)
+        ABORT("fail to flush plfsdir");
+
+      if (pctx.pre_flushing_wait) {
+        if (pctx.my_rank == 0 && pctx.verbose)
+          fputs("waiting for compaction ... (rank 0)\n", stderr);
+        if (pctx.sideio && deltafs_plfsdir_io_wait(pctx.plfshdl) != 0)
+          ABORT("fail to wait for plfsdir side io");
+        if (deltafs_plfsdir_wait(pctx.plfshdl) != 0)
+          ABORT("fail to wait for plfsdir");
+      }
+
+      if (pctx.pre_flushing_sync) {
+        if (pctx.my_rank == 0 && pctx.verbose)
+          fputs("fsync'ing io ... (rank 0)\n", stderr);
+        if (pctx.sideio && deltafs_plfsdir_io_sync(pctx.plfshdl) != 0)
+          ABORT("fail to sync plfsdir side io");
+        if (deltafs_plfsdir_sync(pctx.plfshdl) != 0)
+          ABORT("fail to sync plfsdir");
+      }
+
+      if (pctx.my_rank == 0) {
+        flush_end = now_micros();
+        logf(LOG_INFO, "pre-flushing done %s",
+             pretty_dura(flush_end - flush_start).c_str());
+      }
+    } else {
+      ABORT("plfsdir not opened");
+    }
+
+  } else {
+    /* XXX */
+  }
+}
+
+/*
+ * flush_epoch: seal an epoch. called after all writes of the epoch,
+ * including the ones from remote peers, have been received.
+ */
+static void flush_epoch(int epoch) {
+  uint64_t flush_start;
+  uint64_t flush_end;
+
+  if (IS_BYPASS_WRITE(pctx.mode)) {
+    /* noop */
+
+  } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+    if (pctx.plfshdl != NULL) {
+      if (pctx.my_rank == 0) {
+        flush_start = now_micros();
+        logf(LOG_INFO, "flushing plfsdir ... (rank 0)");
+      }
+      if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
+        ABORT("fail to flush plfsdir side io");
+      if (deltafs_plfsdir_epoch_flush(pctx.plfshdl, epoch) != 0)
+        ABORT("fail to flush plfsdir");
+      if (pctx.my_rank == 0) {
+        flush_end = now_micros();
+        logf(LOG_INFO, "flushing done %s",
+             pretty_dura(flush_end - flush_start).c_str());
+      }
+    } else {
+      ABORT("plfsdir not opened");
+    }
+
+  } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
+    if (pctx.my_rank == 0) {
+      flush_start = now_micros();
+      logf(LOG_INFO, "flushing local logs ... (rank 0)");
+    }
+    flush_local_logs();
+    if (pctx.my_rank == 0) {
+      flush_end = now_micros();
+      logf(LOG_INFO, "flushing done %s",
+           pretty_dura(flush_end - flush_start).c_str());
+    }
+
+  } else if (!IS_BYPASS_DELTAFS_PLFSDIR(pctx.mode)) {
+    if (pctx.plfsfd != -1) {
+      deltafs_epoch_flush(pctx.plfsfd, NULL); /* XXX */
+      if (pctx.my_rank == 0) {
+        logf(LOG_INFO, "plfsdir flushed (rank 0)");
+      }
+    } else {
+      ABORT("plfsdir not opened");
+    }
+
+  } else {
+    /* noop */
+  }
+}
+
+/*
+ * epoch_flusher: with PRELOAD_Async_epoch_flush, an epoch is handed to a
+ * background thread at closedir() once the pre-barrier has ensured no
+ * more writes will come for it. the thread pre-flushes the epoch while
+ * the app computes the next one. as with synchronous flushing, an epoch
+ * is only sealed once the next one begins: opendir(), or an early write
+ * for the next epoch, releases it and waits for the thread to seal it.
+ * the last epoch is never released and is left to plfsdir_finish(), so
+ * it is not sealed twice. plfsdir keeps accepting writes into its
+ * second memtable buffer while the first one is compacted.
+ */
+namespace {
+struct epoch_flusher {
+  pthread_t thread;
+  pthread_mutex_t mtx;
+  pthread_cond_t cv;
+  int submitted;        /* last epoch submitted, -1 if none */
+  int prepared;         /* last epoch pre-flushed, -1 if none */
+  int released;         /* last epoch known not to be final, -1 if none */
+  volatile int flushed; /* last epoch sealed, -1 if none */
+  int shutdown;
+  uint64_t last_dura; /* time spent pre-flushing and sealing an epoch */
+};
+}  // namespace
+
+static epoch_flusher* flusher = NULL;
+
+static void* flusher_main(void* arg) {
+  epoch_flusher* const f = static_cast<epoch_flusher*>(arg);
+  uint64_t start;
+  int epoch;
+
+  pthread_mtx_lock(&f->mtx);
+  while (true) {
+    while (!f->shutdown && f->prepared == f->submitted &&
+           f->flushed == (f->released < f->prepared ? f->released
+                                                    : f->prepared)) {
+      pthread_cv_wait(&f->cv, &f->mtx);
+    }
+    if (f->flushed < f->prepared && f->flushed < f->released) {
+      epoch = f->flushed + 1;
+      pthread_mtx_unlock(&f->mtx);
+      start = now_micros();
+      flush_epoch(epoch);
+      pthread_mtx_lock(&f->mtx);
+      f->last_dura += now_micros() - start;
+      f->flushed = epoch;
+      pthread_cv_notifyall(&f->cv);
+    } else if (f->prepared < f->submitted) {
+      epoch = f->prepared + 1;
+      pthread_mtx_unlock(&f->mtx);
+      start = now_micros();
+      pre_flush_epoch(epoch);
+      pthread_mtx_lock(&f->mtx);
+      f->last_dura = now_micros() - start;
+      f->prepared = epoch;
+      pthread_cv_notifyall(&f->cv);
+    } else {
+      break; /* shutdown, an unreleased epoch is left to plfsdir_finish */
+    }
+  }
+  pthread_mtx_unlock(&f->mtx);
+
+  return NULL;
+}
+
+static void flusher_start() {
+  flusher = new epoch_flusher;
+  pthread_mutex_init(&flusher->mtx, NULL);
+  pthread_cond_init(&flusher->cv, NULL);
+  flusher->submitted = flusher->prepared = flusher->released = -1;
+  flusher->flushed = -1;
+  flusher->shutdown = 0;
+  flusher->last_dura = 0;
+  if (pthread_create(&flusher->thread, NULL, flusher_main, flusher) != 0) {
+    ABORT("pthread_create");
+  }
+}
+
+/* hand an epoch over to the flusher */
+static void flusher_submit(int epoch) {
+  pthread_mtx_lock(&flusher->mtx);
+  assert(epoch == flusher->submitted + 1);
+  flusher->submitted = epoch;
+  pthread_cv_notifyall(&flusher->cv);
+  pthread_mtx_unlock(&flusher->mtx);
+}
+
+/* let an epoch be sealed now that a later one has begun, wait until it is
+ * sealed, and return the time spent waiting */
+static uint64_t flusher_wait(int epoch) {
+  const uint64_t start = now_micros();
+  pthread_mtx_lock(&flusher->mtx);
+  if (flusher->released < epoch) {
+    flusher->released = epoch;
+    pthread_cv_notifyall(&flusher->cv);
+  }
+  while (flusher->flushed < epoch) {
+    pthread_cv_wait(&flusher->cv, &flusher->mtx);
+  }
+  pthread_mtx_unlock(&flusher->mtx);
+  return now_micros() - start;
+}
+
+/* finish all pending pre-flushes and stop the flusher */
+static void flusher_stop() {
+  pthread_mtx_lock(&flusher->mtx);
+  flusher->shutdown = 1;
+  pthread_cv_notifyall(&flusher->cv);
+  pthread_mtx_unlock(&flusher->mtx);
+  pthread_join(flusher->thread, NULL);
+  pthread_cond_destroy(&flusher->cv);
+  pthread_mutex_destroy(&flusher->mtx);
+  delete flusher;
+  flusher = NULL;
+}
 
 /* number of pthread created */
 static int num_pthreads = 0;
@@ -82,9 +355,9 @@ static int num_barriers = 0;
 static int num_eps = 0;
 
 /*
- * buffer space for generating fake particle data.
+ * synthetic particle generator used when PRELOAD_Inject_fake_data is set.
  */
-static char particle_buf[64];
+static particle_gen_t fake_gen;
 
 /*
  * we use the address of fake_dirptr as a fake DIR* with opendir/closedir
@@ -119,6 +392,227 @@ static struct next_functions {
   long (*ftell)(FILE* stream);
 } nxt = {0};
 
+namespace {
+struct fake_file_pool;
+
+/*
+ * fake_file is a replacement for FILE* that we use to accumulate all the
+ * VPIC particle data before sending it to the shuffle layer (on fclose).
+ *
+ * we assume only one thread is writing to the file at a time, so we
+ * do not put a mutex on it. different threads may have different files
+ * opened at the same time.
+ *
+ * each fake_file starts with a magic number so that we can tell it apart
+ * from a real FILE* without a lookup. the magic number is placed where
+ * libc keeps the flags word of a real FILE, whose high bits are always
+ * _IO_MAGIC (0xFBAD0000) and thus can never match ours.
+ *
+ * we ignore out of memory errors.
+ */
+#define FAKE_FILE_MAGIC 0x46414b4546494c45ULL /* "FAKEFILE" */
+class fake_file {
+ private:
+  volatile uint64_t magic_; /* must be the first member */
+  std::string path_;        /* path of particle file (malloc'd c++) */
+  std::string data_;        /* particle data, reserved for one particle */
+  size_t cap_;              /* max bytes of data */
+
+  /* large enough for one particle, and no less than one VPIC particle */
+  static size_t capacity() {
+    return (pctx.particle_size > 64) ? size_t(pctx.particle_size) : 64;
+  }
+
+ public:
+  fake_file_pool* owner; /* pool we come from (NULL if heap allocated) */
+  fake_file* next;       /* next free file in the owner pool */
+
+  fake_file()
+      : magic_(FAKE_FILE_MAGIC), cap_(capacity()), owner(NULL), next(NULL) {
+    path_.reserve(256);
+    data_.reserve(cap_);
+  }
+
+  void reset(const char* path) {
+    path_.assign(path);
+    data_.clear();
+  }
+
+  explicit fake_file(const char* path)
+      : magic_(FAKE_FILE_MAGIC),
+        path_(path),
+        cap_(capacity()),
+        owner(NULL),
+        next(NULL) {
+    data_.reserve(cap_);
+  }
+
+  ~fake_file() { magic_ = 0; }
+
+  /* returns the actual number of bytes added. */
+  size_t add_data(const void* toadd, size_t len) {
+    size_t n = (len > cap_ - data_.size()) ? cap_ - data_.size() : len;
+    if (n) {
+      data_.append(static_cast<const char*>(toadd), n);
+    }
+    return n;
+  }
+
+  /* get data length */
+  size_t size() { return data_.size(); }
+
+  /* recover filename. */
+  const char* file_name() { return path_.c_str(); }
+
+  /* get data */
+  char* data() { return &data_[0]; }
+};
+
+/*
+ * fake_file_pool: a per-thread set of preallocated fake_files. a thread
+ * opens and closes its own files without any locking or heap allocation.
+ * files closed by a thread other than the owner are put on a separate
+ * remote list that is protected by the pool's own mutex and that the owner
+ * reclaims once it runs out of local files. a pool is freed once its owner
+ * thread has exited and all its files have been returned.
+ */
+struct fake_file_pool {
+  pthread_mutex_t mtx; /* protects remote and orphaned */
+  fake_file* remote;   /* files returned by other threads */
+  int orphaned;        /* owner thread has exited */
+  fake_file* local;    /* free files (owner thread only) */
+  int nout;            /* files currently handed out */
+  fake_file* files;    /* backing storage */
+};
+
+/* per-thread pool handle */
+pthread_key_t pool_key;
+
+/* number of files preallocated per pool */
+int pool_size = DEFAULT_FAKE_FILE_POOL_SIZE;
+
+/* set once we have warned about an exhausted pool */
+int pool_warned = 0;
+
+/* number of plfsdir files currently opened */
+int num_open_files = 0;
+
+fake_file_pool* pool_create() {
+  fake_file_pool* const pool = new fake_file_pool;
+  pthread_mutex_init(&pool->mtx, NULL);
+  pool->remote = NULL;
+  pool->orphaned = 0;
+  pool->local = NULL;
+  pool->nout = 0;
+  pool->files = new fake_file[pool_size];
+  for (int i = pool_size - 1; i >= 0; i--) {
+    pool->files[i].owner = pool;
+    pool->files[i].next = pool->local;
+    pool->local = &pool->files[i];
+  }
+  return pool;
+}
+
+void pool_destroy(fake_file_pool* pool) {
+  pthread_mutex_destroy(&pool->mtx);
+  delete[] pool->files;
+  delete pool;
+}
+
+/* move files returned by other threads back to the local list */
+void pool_reclaim(fake_file_pool* pool) {
+  fake_file* ff;
+  pthread_mtx_lock(&pool->mtx);
+  ff = pool->remote;
+  pool->remote = NULL;
+  pthread_mtx_unlock(&pool->mtx);
+  while (ff != NULL) {
+    fake_file* const next = ff->next;
+    ff->next = pool->local;
+    pool->local = ff;
+    pool->nout--;
+    ff = next;
+  }
+}
+
+/* called by pthreads when the owner thread exits */
+void pool_orphan(void* arg) {
+  fake_file_pool* const pool = static_cast<fake_file_pool*>(arg);
+  pthread_mtx_lock(&pool->mtx);
+  for (fake_file* ff = pool->remote; ff != NULL; ff = ff->next) {
+    pool->nout--;
+  }
+  pool->remote = NULL;
+  pool->orphaned = 1;
+  int done = (pool->nout == 0);
+  pthread_mtx_unlock(&pool->mtx);
+  if (done) {
+    pool_destroy(pool);
+  }
+}
+
+/* obtain a free file for the calling thread */
+fake_file* fake_file_get(const char* path) {
+  fake_file_pool* pool;
+  fake_file* ff;
+
+  pool = static_cast<fake_file_pool*>(pthread_getspecific(pool_key));
+  if (pool == NULL) {
+    pool = pool_create();
+    if (pthread_setspecific(pool_key, pool) != 0) {
+      ABORT("pthread_setspecific");
+    }
+  }
+  if (pool->local == NULL) {
+    pool_reclaim(pool);
+  }
+  ff = pool->local;
+  if (ff != NULL) {
+    pool->local = ff->next;
+    pool->nout++;
+    ff->reset(path);
+    return ff;
+  }
+
+  if (__sync_bool_compare_and_swap(&pool_warned, 0, 1)) {
+    logf(LOG_WARN,
+         "VPIC IS OPENING TOO MANY PLFSDIR FILES SIMULTANEOUSLY!\n>>> "
+         "consider raising PRELOAD_Fake_file_pool_size (now %d)",
+         pool_size);
+  }
+  return new fake_file(path);
+}
+
+/* return a file to the pool it comes from */
+void fake_file_put(fake_file* ff) {
+  fake_file_pool* const pool = ff->owner;
+  int done;
+
+  if (pool == NULL) {
+    delete ff;
+  } else if (pool == pthread_getspecific(pool_key)) {
+    ff->next = pool->local;
+    pool->local = ff;
+    pool->nout--;
+  } else {
+    pthread_mtx_lock(&pool->mtx);
+    if (!pool->orphaned) {
+      ff->next = pool->remote;
+      pool->remote = ff;
+      done = 0;
+    } else {
+      pool->nout--;
+      done = (pool->nout == 0);
+    }
+    pthread_mtx_unlock(&pool->mtx);
+    if (done) {
+      pool_destroy(pool);
+    }
+  }
+}
+
+}  // namespace
+
 /*
  * this once is used to trigger the init of the preload library...
  */
@@ -165,16 +659,19 @@ static void preload_init() {
 
   pctx.trace = NULL;
 
+  if (pthread_key_create(&pool_key, pool_orphan) != 0)
+    ABORT("pthread_key_create");
+
 #ifdef PRELOAD_HAS_PAPI
   pctx.papi_events = new std::vector<const char*>;
   pctx.papi_set = PAPI_NULL;
 #endif
 
-  pctx.isdeltafs = new std::set<FILE*>;
   pctx.fnames = new std::set<std::string>;
-  pctx.smap = new std::map<std::string, int>;
+  pctx.nfilter = new name_filter;
 
   pctx.mpi_wait = DEFAULT_MPI_WAIT;
+  pctx.barrier_spin = DEFAULT_BARRIER_SPIN;
   pctx.particle_id_size = DEFAULT_PARTICLE_ID_BYTES;
   pctx.particle_extra_size = DEFAULT_PARTICLE_EXTRA_BYTES;
   pctx.particle_size = DEFAULT_PARTICLE_BYTES;
@@ -336,6 +833,32 @@ static void preload_init() {
     }
   }
 
+  pschema_init(&pctx.pschema);
+  if (pctx.pschema.size > pctx.particle_size) {
+    /* the vpic default is allowed to not fit; code reading particle fields
+     * checks the schema size before using it */
+    if (maybe_getenv("PRELOAD_Particle_schema") != NULL ||
+        maybe_getenv("PRELOAD_Particle_schema_file") != NULL) {
+      ABORT("particle schema larger than particle size");
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Fake_file_pool_size");
+  if (tmp != NULL) {
+    pool_size = atoi(tmp);
+    if (pool_size < 1) {
+      pool_size = 1;
+    }
+  }
+
+  tmp = maybe_getenv("PRELOAD_Num_write_lanes");
+  if (tmp != NULL) {
+    num_lanes = atoi(tmp);
+    if (num_lanes < 1) {
+      num_lanes = 1;
+    }
+  }
+
   tmp = maybe_getenv("PRELOAD_Mpi_wait");
   if (tmp != NULL) {
     pctx.mpi_wait = atoi(tmp);
@@ -344,6 +867,12 @@ static void preload_init() {
     }
   }
 
+  tmp = maybe_getenv("PRELOAD_Barrier_spin_us");
+  if (tmp != NULL) {
+    pctx.barrier_spin = (atoi(tmp) > 0) ? uint64_t(atoi(tmp)) : 0;
+  }
+  if (is_envset("PRELOAD_Barrier_yield")) pctx.barrier_yield = 1;
+
   if (is_envset("PRELOAD_Skip_sampling")) pctx.sampling = 0;
 
   tmp = maybe_getenv("PRELOAD_Sample_threshold");
@@ -399,9 +928,18 @@ static void preload_init() {
   if (is_envset("PRELOAD_Enable_wisc")) pctx.sideio = 1;
 
   if (is_envset("PRELOAD_No_paranoid_checks")) pctx.paranoid_checks = 0;
+  if (is_envset("PRELOAD_Paranoid_exact_names"))
+    pctx.paranoid_exact_names = 1;
+  if (pctx.paranoid_checks && !pctx.paranoid_exact_names) {
+    tmp = maybe_getenv("PRELOAD_Name_filter_size");
+    pctx.nfilter->init((tmp != NULL && atoi(tmp) > 0)
+                           ? size_t(atoi(tmp))
+                           : size_t(DEFAULT_NAME_FILTER_SIZE));
+  }
   if (is_envset("PRELOAD_No_paranoid_pre_barrier"))
     pctx.paranoid_pre_barrier = 0;
   if (is_envset("PRELOAD_No_epoch_pre_flushing")) pctx.pre_flushing = 0;
+  if (is_envset("PRELOAD_Async_epoch_flush")) pctx.async_epoch_flush = 1;
   if (is_envset("PRELOAD_No_epoch_pre_flushing_wait"))
     pctx.pre_flushing_wait = 0;
   if (is_envset("PRELOAD_No_epoch_pre_flushing_sync"))
@@ -410,7 +948,10 @@ static void preload_init() {
   if (is_envset("PRELOAD_No_paranoid_post_barrier"))
     pctx.paranoid_post_barrier = 0;
   if (is_envset("PRELOAD_No_sys_probing")) pctx.noscan = 1;
-  if (is_envset("PRELOAD_Inject_fake_data")) pctx.fake_data = 1;
+  if (is_envset("PRELOAD_Inject_fake_data")) {
+    pgen_init(&fake_gen, &pctx.pschema);
+    pctx.fake_data = 1;
+  }
   if (is_envset("PRELOAD_Testing")) pctx.testin = 1;
 
   /* additional init can go here or MPI_Init() */
@@ -432,6 +973,48 @@ static int should_ignore(const char* path) {
   return 0;
 }
 
+/*
+ * check_names: count collisions (mctx.ncw) among particle names. there are
+ * n names of len bytes each placed stride bytes apart. unless exact
+ * checking is requested, names go to a bloom filter and no lock is needed.
+ */
+static void check_names(const char* names, size_t len, size_t stride,
+                        size_t n) {
+  if (!pctx.paranoid_exact_names) {
+    unsigned long long ncw = 0;
+    for (size_t i = 0; i < n; i++) {
+      ncw += pctx.nfilter->add(names + i * stride, len);
+    }
+    if (ncw != 0) {
+      __sync_fetch_and_add(&pctx.mctx.ncw, ncw);
+    }
+  } else {
+    pthread_mtx_lock(&preload_mtx);
+    for (size_t i = 0; i < n; i++) {
+      std::string name(names + i * stride, len);
+      if (pctx.fnames->count(name) == 0) {
+        pctx.fnames->insert(name);
+      } else {
+        pctx.mctx.ncw++;
+      }
+    }
+    pthread_mtx_unlock(&preload_mtx);
+  }
+}
+
+/*
+ * reset_names: forget all names seen so far.
+ */
+static void reset_names() {
+  if (!pctx.paranoid_checks) {
+    /* noop */
+  } else if (!pctx.paranoid_exact_names) {
+    pctx.nfilter->clear();
+  } else {
+    pctx.fnames->clear();
+  }
+}
+
 /*
  * claim_path: look at path to see if we can claim it
  */
@@ -457,83 +1040,15 @@ static int under_plfsdir(const char* path) {
   return 0;
 }
 
-namespace {
-/*
- * fake_file is a replacement for FILE* that we use to accumulate all the
- * VPIC particle data before sending it to the shuffle layer (on fclose).
- *
- * we assume only one thread is writing to the file at a time, so we
- * do not put a mutex on it.
- *
- * we ignore out of memory errors.
- */
-class fake_file {
- private:
-  std::string path_; /* path of particle file (malloc'd c++) */
-  char data_[64];    /* enough for one VPIC particle */
-  char* dptr_;       /* ptr to next free space in data_ */
-  size_t resid_;     /* residual */
-
- public:
-  fake_file() : dptr_(data_), resid_(sizeof(data_)) { path_.reserve(256); }
-
-  void reset(const char* path) {
-    path_.assign(path);
-    resid_ = sizeof(data_);
-    dptr_ = data_;
-  }
-
-  explicit fake_file(const char* path)
-      : path_(path), dptr_(data_), resid_(sizeof(data_)){};
-
-  /* returns the actual number of bytes added. */
-  size_t add_data(const void* toadd, size_t len) {
-    int n = (len > resid_) ? resid_ : len;
-    if (n) {
-      memcpy(dptr_, toadd, n);
-      dptr_ += n;
-      resid_ -= n;
-    }
-    return n;
-  }
-
-  /* get data length */
-  size_t size() { return sizeof(data_) - resid_; }
-
-  /* recover filename. */
-  const char* file_name() { return path_.c_str(); }
-
-  /* get data */
-  char* data() { return data_; }
-};
-
-/* avoids repeated malloc if vpic only opens one file a time */
-fake_file the_stock_file;
-fake_file* stock_file = &the_stock_file;
-
-}  // namespace
-
 /*
- * claim_FILE: look at FILE* and see if we claim it
+ * claim_FILE: look at FILE* and see if we claim it. this is called on every
+ * stdio call so we do it without locking: a FILE* is ours iff it carries
+ * our magic number. a real FILE is at least as large as our magic number
+ * so reading it is always safe.
  */
-static int claim_FILE(FILE* stream) {
-  std::set<FILE*>::iterator it;
-  int rv;
-
-  pthread_mtx_lock(&preload_mtx);
-
-  if (stream != reinterpret_cast<FILE*>(&the_stock_file)) {
-    assert(pctx.isdeltafs != NULL);
-    it = pctx.isdeltafs->find(stream);
-    rv = (it != pctx.isdeltafs->end());
-
-  } else {
-    rv = 1;
-  }
-
-  pthread_mtx_unlock(&preload_mtx);
-
-  return rv;
+static inline int claim_FILE(FILE* stream) {
+  if (stream == NULL) return 0;
+  return (*reinterpret_cast<volatile uint64_t*>(stream) == FAKE_FILE_MAGIC);
 }
 
 /*
@@ -545,6 +1060,9 @@ static void dump_mon(mon_ctx_t* mon, dir_stat_t* tmp_stat,
   uint64_t ts;
 
   if (!pctx.nomon) {
+    /* nw is the only write counter bumped by fopen */
+    mon->min_nw = mon->max_nw = mon->nw;
+
     /* collect stats from deltafs */
     if (pctx.plfshdl != NULL) {
       mon_fetch_plfsdir_stat(pctx.plfshdl, tmp_stat);
@@ -736,6 +1254,70 @@ static std::string& pretty_plfsdir_conf(std::string& conf) {
   return conf;
 }
 
+/*
+ * ship_particle: send a particle to the shuffle layer, or write it directly
+ * when the shuffle is bypassed. fname must be null-terminated.
+ */
+static int ship_particle(const char* fname, size_t fname_len, char* data,
+                         size_t data_len) {
+  uint64_t off;
+  ssize_t n;
+  int rv;
+
+  off = 0;
+
+  if (pctx.paranoid_checks) {
+    if (pctx.particle_id_size != fname_len) {
+      ABORT("bad particle id size");
+    }
+    if (pctx.particle_size != data_len) {
+      ABORT("bad particle size");
+    }
+  }
+
+  /* fake data goes in before the shuffle so it drives the partitioning */
+  if (pctx.fake_data) {
+    pgen_fill(&fake_gen, data, data_len);
+  }
+
+  if (pctx.sideio) {
+    if (IS_BYPASS_WRITE(pctx.mode)) {
+      /* empty */
+
+    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
+      assert(pctx.plfshdl != NULL);
+      n = deltafs_plfsdir_io_append(pctx.plfshdl, data, data_len);
+
+      if (n != data_len) {
+        ABORT("plfsdir sideio write failed");
+      }
+
+    } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
+      ABORT("not implemented");
+
+    } else {
+      ABORT("not implemented");
+    }
+
+    data_len = sizeof(off);
+    data = reinterpret_cast<char*>(&off);
+  }
+
+  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
+    rv = pctx.sh_udf->process(fname, fname_len, data, data_len, num_eps - 1);
+    if (rv) {
+      ABORT("plfsdir shuffler write failed");
+    }
+  } else {
+    rv = native_write(fname, fname_len, data, data_len, num_eps - 1);
+    if (rv) {
+      ABORT("plfsdir write failed");
+    }
+  }
+
+  return rv;
+}
+
 /*
  * here are the actual override functions from libc...
  */
@@ -748,6 +1330,7 @@ int MPI_Init(int* argc, char*** argv) {
   int exact;
   const char* env;
   const char* stripped;
+  char logdir[PATH_MAX];
   char dirpath[PATH_MAX];
   char path[PATH_MAX];
   std::string conf;
@@ -771,6 +1354,8 @@ int MPI_Init(int* argc, char*** argv) {
   rv = pthread_once(&init_once, preload_init);
   if (rv) ABORT("pthread_once");
 
+  logdir[0] = 0;
+
   rv = nxt.MPI_Init(argc, argv);
   if (rv == MPI_SUCCESS) {
     MPI_Comm_size(MPI_COMM_WORLD, &pctx.comm_sz);
@@ -784,8 +1369,10 @@ int MPI_Init(int* argc, char*** argv) {
         logf(LOG_INFO, "deltafs %d.%d.%d", deltafs_major, deltafs_minor,
              deltafs_patch);
       }
-      logf(LOG_INFO, "LIB initializing ... %s MPI ranks (MPI wait=%d ms)",
-           pretty_num(pctx.comm_sz).c_str(), pctx.mpi_wait);
+      logf(LOG_INFO,
+           "LIB initializing ... %s MPI ranks (MPI wait=%d ms, spin=%d us)",
+           pretty_num(pctx.comm_sz).c_str(), pctx.mpi_wait,
+           int(pctx.barrier_spin));
       if (pctx.print_meminfo) {
         print_meminfo();
       }
@@ -908,6 +1495,18 @@ int MPI_Init(int* argc, char*** argv) {
     } else {
       ABORT("!fopen");
     }
+
+    if (is_envset("PRELOAD_Trace_binary")) {
+      uint64_t ring_sz = DEFAULT_TRACE_RING_SIZE;
+      env = maybe_getenv("PRELOAD_Trace_ring_size");
+      if (env != NULL && atoi(env) > 0) {
+        ring_sz = atoi(env);
+      }
+      snprintf(path, sizeof(path), "%s/vpic-deltafs-trace.bin.%d", dirpath,
+               pctx.my_rank);
+      bin_trace_open(path, pctx.my_rank, ring_sz);
+      pctx.trace_bin = 1;
+    }
   }
 
   /* obtain number of logic cpu cores */
@@ -949,6 +1548,8 @@ int MPI_Init(int* argc, char*** argv) {
     if (pctx.my_rank == 0) {
       logf(LOG_INFO, "particle id: %d bytes, data: %d (+ %d) bytes",
            pctx.particle_id_size, pctx.particle_size, pctx.particle_extra_size);
+      logf(LOG_INFO, "particle schema: %s",
+           pschema_str(&pctx.pschema).c_str());
     }
 
     /* everyone is a receiver by default. when shuffle is enabled, some ranks
@@ -1072,8 +1673,10 @@ int MPI_Init(int* argc, char*** argv) {
               logf(LOG_INFO, conf.c_str());
             }
           }
-        } else if (!IS_BYPASS_DELTAFS_PLFSDIR(pctx.mode) &&
-                   !IS_BYPASS_DELTAFS(pctx.mode)) {
+        } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
+          /* logs are opened along with the write lanes */
+          snprintf(logdir, sizeof(logdir), "%s/%s", pctx.local_root, stripped);
+        } else if (!IS_BYPASS_DELTAFS_PLFSDIR(pctx.mode)) {
           pctx.plfsfd = deltafs_open(stripped, O_WRONLY | O_DIRECTORY, 0);
           if (pctx.plfsfd == -1) {
             ABORT("cannot open plfsdir");
@@ -1084,6 +1687,54 @@ int MPI_Init(int* argc, char*** argv) {
       }
     }
 
+    /* one write lane per memtable partition unless told otherwise */
+    if (num_lanes == 0) {
+      num_lanes = (pctx.plfsparts > 0) ? pctx.plfsparts : 1;
+    }
+    for (n = 1; n < num_lanes; n <<= 1) {
+    }
+    num_lanes = n;
+    lanes = new write_lane[num_lanes];
+    for (n = 0; n < num_lanes; n++) {
+      pthread_mutex_init(&lanes[n].mtx, NULL);
+      /* sized for ~1M particles per rank, grown as needed */
+      lanes[n].smpls.init(pctx.particle_id_size,
+                          2 * size_t(pctx.sthres) / num_lanes);
+      lanes[n].llog = NULL;
+      if (logdir[0] != 0) {
+        lanes[n].llog = new local_log;
+        if (lanes[n].llog->open(logdir, pctx.my_rank, n,
+                                pctx.particle_id_size,
+                                pctx.particle_buf_size) != 0) {
+          ABORT("cannot open local log");
+        }
+      }
+    }
+    if (pctx.my_rank == 0 && logdir[0] != 0) {
+      logf(LOG_INFO, "local logs opened\n>>> io buf size: %s",
+           pretty_size(pctx.particle_buf_size).c_str());
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "plfsdir writes spread over %d lanes", num_lanes);
+    }
+
+    /* the flusher relies on the pre-barrier to know an epoch is complete */
+    if (pctx.async_epoch_flush) {
+      if (!pctx.paranoid_pre_barrier || pctx.bgpause) {
+        if (pctx.my_rank == 0) {
+          logf(LOG_WARN,
+               "async epoch flush requires the pre-barrier and no bg "
+               "pause: disabled");
+        }
+        pctx.async_epoch_flush = 0;
+      } else if (pctx.recv_comm != MPI_COMM_NULL) {
+        flusher_start();
+        if (pctx.my_rank == 0) {
+          logf(LOG_INFO, "epochs are flushed in background");
+        }
+      }
+    }
+
     if (!pctx.nomon) {
       snprintf(dirpath, sizeof(dirpath), "/tmp/vpic-deltafs-run-%u",
                static_cast<unsigned>(uid));
@@ -1146,7 +1797,9 @@ int MPI_Init(int* argc, char*** argv) {
       }
 
       if (pctx.fake_data) {
-        logf(LOG_WARN, "fake_data is on");
+        logf(LOG_WARN, "fake_data is on: %s (uth=%g, tail=%g/%g, skew=%g)",
+             pgen_dist_name(fake_gen.dist), fake_gen.uth,
+             fake_gen.tail_frac, fake_gen.tail_index, fake_gen.skew);
       }
       if (pctx.paranoid_checks)
         logf(LOG_WARN,
@@ -1215,6 +1868,8 @@ int MPI_Finalize(void) {
   char suffix[100];
   /* total num of pthreads */
   int sum_pthreads;
+  /* barrier waits summed over all ranks */
+  barrier_stat_t barrier_sum;
   /* total num of barriers */
   int sum_barriers;
   unsigned long long num_writes_min; /* per rank */
@@ -1334,6 +1989,11 @@ int MPI_Finalize(void) {
       pctx.sh_udf->finalize();
     } // IS_BYPASS_SHUFFLE
 
+    /* the last epoch may still be flushing */
+    if (flusher != NULL) {
+      flusher_stop();
+    }
+
 
     /* all writes are concluded, do the last flush, finish the directory,
      * retrieve final mon stats, and free the directory. note that the mon stats
@@ -1390,6 +2050,20 @@ int MPI_Finalize(void) {
         logf(LOG_INFO, "plfsdir closed (rank 0)");
       }
     } else {
+      finish_start = now_micros();
+      for (n = 0; n < num_lanes; n++) {
+        if (lanes[n].llog != NULL) {
+          if (lanes[n].llog->close() != 0) {
+            ABORT("fail to close local log");
+          }
+          num_files_writ += lanes[n].llog->files_written();
+          num_bytes_writ += lanes[n].llog->bytes_written();
+          delete lanes[n].llog;
+          lanes[n].llog = NULL;
+        }
+      }
+      finish_end = now_micros();
+      finish_dura = double(finish_end - finish_start) / 1000.0 / 1000.0;
       if (num_eps != 0) {
         dump_mon(&pctx.mctx, &tmp_stat, &pctx.last_dir_stat);
       }
@@ -1406,11 +2080,13 @@ int MPI_Finalize(void) {
     /* conclude sampling */
     if (pctx.sampling && pctx.recv_comm != MPI_COMM_NULL) {
       num_samples[0] = num_samples[1] = 0;
-      for (std::map<std::string, int>::const_iterator it = pctx.smap->begin();
-           it != pctx.smap->end(); ++it) {
-        num_samples[0]++; /* number samples */
-        if (it->second == num_eps) {
-          num_samples[1]++; /* number valid samples */
+      for (int i = 0; i < num_lanes; i++) {
+        const sample_table& t = lanes[i].smpls;
+        num_samples[0] += t.size(); /* number samples */
+        for (size_t j = 0; j < t.capacity(); j++) {
+          if (t.used(j) && t.count_at(j) == num_eps) {
+            num_samples[1]++; /* number valid samples */
+          }
         }
       }
       MPI_Reduce(num_samples, sum_samples, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM,
@@ -1433,18 +2109,20 @@ int MPI_Finalize(void) {
         if (f0 != NULL) {
           if (pctx.my_rank == 0 && pctx.verbose)
             fputs("dumped names = (\n    ...\n", stderr);
-          for (std::map<std::string, int>::const_iterator it =
-                   pctx.smap->begin();
-               it != pctx.smap->end(); ++it) {
-            if (it->second == num_eps) {
-              fprintf(f0, "%s\n", it->first.c_str());
-
-              num_names++;
-              if (pctx.my_rank && pctx.verbose) {
-                if (num_names <= 7) {
-                  fputs(" !! ", stderr);
-                  fputs(it->first.c_str(), stderr);
-                  fputc('\n', stderr);
+          for (int i = 0; i < num_lanes; i++) {
+            const sample_table& t = lanes[i].smpls;
+            for (size_t j = 0; j < t.capacity(); j++) {
+              if (t.used(j) && t.count_at(j) == num_eps) {
+                fwrite(t.key_at(j), 1, pctx.particle_id_size, f0);
+                fputc('\n', f0);
+
+                num_names++;
+                if (pctx.my_rank && pctx.verbose) {
+                  if (num_names <= 7) {
+                    fputs(" !! ", stderr);
+                    fwrite(t.key_at(j), 1, pctx.particle_id_size, stderr);
+                    fputc('\n', stderr);
+                  }
                 }
               }
             }
@@ -1753,6 +2431,8 @@ int MPI_Finalize(void) {
              MPI_COMM_WORLD);
   MPI_Reduce(&num_pthreads, &sum_pthreads, 1, MPI_INT, MPI_SUM, 0,
              MPI_COMM_WORLD);
+  MPI_Reduce(&pctx.barrier_stat, &barrier_sum, 4, MPI_UNSIGNED_LONG_LONG,
+             MPI_SUM, 0, MPI_COMM_WORLD);
 
   if (pctx.my_rank == 0) {
     logf(LOG_INFO, "final stats...");
@@ -1767,9 +2447,26 @@ int MPI_Finalize(void) {
     logf(LOG_INFO, "== ALL epochs");
     logf(LOG_INFO, "       > %.1f per rank",
          double(sum_pthreads) / pctx.comm_sz);
+    logf(LOG_INFO, "== barriers");
+    logf(LOG_INFO, "   > %llu barriers, %.1f polls per barrier",
+         barrier_sum.num / pctx.comm_sz,
+         barrier_sum.num != 0 ? double(barrier_sum.polls) / barrier_sum.num
+                              : 0.0);
+    logf(LOG_INFO, "       > spin %s, backoff %s per rank",
+         pretty_dura(barrier_sum.spin_micros / pctx.comm_sz).c_str(),
+         pretty_dura(barrier_sum.sleep_micros / pctx.comm_sz).c_str());
+  }
+
+  /* close testing log files */
+  if (pctx.trace_bin) {
+    unsigned long long drops = bin_trace_close();
+    if (drops != 0) {
+      logf(LOG_WARN, "%s trace events dropped (rank %d)\n>>> "
+           "raise PRELOAD_Trace_ring_size to keep them",
+           pretty_num(drops).c_str(), pctx.my_rank);
+    }
+    pctx.trace_bin = 0;
   }
-
-  /* close testing log file */
   if (pctx.trace != NULL) {
     fflush(pctx.trace);
     fclose(pctx.trace);
@@ -1857,8 +2554,7 @@ int mkdir(const char* dir, mode_t mode) {
 DIR* opendir(const char* dir) {
   int ignored_exact;
   dir_stat_t tmp_dir_stat;
-  uint64_t flush_start;
-  uint64_t flush_end;
+  uint64_t flush_wait;
   uint64_t start;
   DIR* rv;
 
@@ -1931,42 +2627,18 @@ DIR* opendir(const char* dir) {
      * epoch flush may also be triggered by an unexpected
      * write from a remote peer.
      *
+     * the async flusher gets around this by relying on the pre-barrier
+     * at closedir(), so all we do here is to wait for it.
      */
-    if (IS_BYPASS_WRITE(pctx.mode)) {
-      /* noop */
-
-    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      if (pctx.plfshdl != NULL) {
-        if (pctx.my_rank == 0) {
-          flush_start = now_micros();
-          logf(LOG_INFO, "flushing plfsdir ... (rank 0)");
-        }
-        if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
-          ABORT("fail to flush plfsdir side io");
-        if (deltafs_plfsdir_epoch_flush(pctx.plfshdl, num_eps - 1) != 0)
-          ABORT("fail to flush plfsdir");
-        if (pctx.my_rank == 0) {
-          flush_end = now_micros();
-          logf(LOG_INFO, "flushing done %s",
-               pretty_dura(flush_end - flush_start).c_str());
-        }
-      } else {
-        ABORT("plfsdir not opened");
-      }
-
-    } else if (!IS_BYPASS_DELTAFS_PLFSDIR(pctx.mode) &&
-               !IS_BYPASS_DELTAFS(pctx.mode)) {
-      if (pctx.plfsfd != -1) {
-        deltafs_epoch_flush(pctx.plfsfd, NULL); /* XXX */
-        if (pctx.my_rank == 0) {
-          logf(LOG_INFO, "plfsdir flushed (rank 0)");
-        }
-      } else {
-        ABORT("plfsdir not opened");
+    if (flusher != NULL) {
+      flush_wait = flusher_wait(num_eps - 1);
+      if (pctx.my_rank == 0) {
+        logf(LOG_INFO, "epoch flushed in background %s, waited %s (rank 0)",
+             pretty_dura(flusher->last_dura).c_str(),
+             pretty_dura(flush_wait).c_str());
       }
-
     } else {
-      /* noop */
+      flush_epoch(num_eps - 1);
     }
   }
 
@@ -1982,6 +2654,9 @@ DIR* opendir(const char* dir) {
 
   /* epoch count is increased before the beginning of each epoch */
   num_eps++; /* must go before the barrier below */
+  if (pctx.fake_data) {
+    pgen_epoch(&fake_gen, pctx.my_rank, num_eps - 1);
+  }
 
   if (pctx.paranoid_post_barrier) {
     /*
@@ -2028,7 +2703,7 @@ DIR* opendir(const char* dir) {
   }
 
   /* restart paranoid checking status */
-  pctx.fnames->clear();
+  reset_names();
 
   return rv;
 }
@@ -2039,8 +2714,6 @@ DIR* opendir(const char* dir) {
 int closedir(DIR* dirp) {
   uint64_t tmp_usage_snaptime;
   struct rusage tmp_usage;
-  uint64_t flush_start;
-  uint64_t flush_end;
   double cpu;
   int rv;
 
@@ -2054,11 +2727,10 @@ int closedir(DIR* dirp) {
   if (pctx.my_rank == 0) logf(LOG_INFO, "dumping done!!!");
 
   if (pctx.paranoid_checks) {
-    assert(pctx.isdeltafs != NULL);
-    if (!pctx.isdeltafs->empty()) {
+    if (num_open_files != 0) {
       ABORT("some plfsdir files still open!");
     }
-    pctx.fnames->clear();
+    reset_names();
   }
 
   /* flush the rpc buffer and drain all on-going rpcs */
@@ -2076,52 +2748,10 @@ int closedir(DIR* dirp) {
   }
 
   /* epoch pre-flush */
-  if (pctx.pre_flushing && pctx.recv_comm != MPI_COMM_NULL) {
-    if (IS_BYPASS_WRITE(pctx.mode)) {
-      /* noop */
-
-    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      if (pctx.plfshdl != NULL) {
-        if (pctx.my_rank == 0) {
-          flush_start = now_micros();
-          logf(LOG_INFO, "pre-flushing plfsdir ... (rank 0)");
-        }
-
-        if (pctx.sideio && deltafs_plfsdir_io_flush(pctx.plfshdl) != 0)
-          ABORT("fail to flush plfsdir side io");
-        if (deltafs_plfsdir_flush(pctx.plfshdl, num_eps - 1) != 0)
-          ABORT("fail to flush plfsdir");
-
-        if (pctx.pre_flushing_wait) {
-          if (pctx.my_rank == 0 && pctx.verbose)
-            fputs("waiting for compaction ... (rank 0)\n", stderr);
-          if (pctx.sideio && deltafs_plfsdir_io_wait(pctx.plfshdl) != 0)
-            ABORT("fail to wait for plfsdir side io");
-          if (deltafs_plfsdir_wait(pctx.plfshdl) != 0)
-            ABORT("fail to wait for plfsdir");
-        }
-
-        if (pctx.pre_flushing_sync) {
-          if (pctx.my_rank == 0 && pctx.verbose)
-            fputs("fsync'ing io ... (rank 0)\n", stderr);
-          if (pctx.sideio && deltafs_plfsdir_io_sync(pctx.plfshdl) != 0)
-            ABORT("fail to sync plfsdir side io");
-          if (deltafs_plfsdir_sync(pctx.plfshdl) != 0)
-            ABORT("fail to sync plfsdir");
-        }
-
-        if (pctx.my_rank == 0) {
-          flush_end = now_micros();
-          logf(LOG_INFO, "pre-flushing done %s",
-               pretty_dura(flush_end - flush_start).c_str());
-        }
-      } else {
-        ABORT("plfsdir not opened");
-      }
-
-    } else {
-      /* XXX */
-    }
+  if (flusher != NULL) {
+    flusher_submit(num_eps - 1);
+  } else if (pctx.pre_flushing && pctx.recv_comm != MPI_COMM_NULL) {
+    pre_flush_epoch(num_eps - 1);
   }
 
 #ifdef PRELOAD_HAS_PAPI
@@ -2233,31 +2863,15 @@ FILE* fopen(const char* fpath, const char* mode) {
     stripped = (exact) ? "/" : (fpath + pctx.len_deltafs_mntp);
   }
 
-  pthread_mtx_lock(&preload_mtx);
   if (pctx.paranoid_checks) {
     fname = stripped + pctx.len_plfsdir + 1;
-    if (pctx.fnames->count(fname) == 0) {
-      pctx.fnames->insert(fname);
-    } else {
-      pctx.mctx.ncw++;
-    }
-  }
-  pctx.mctx.min_nw++;
-  pctx.mctx.max_nw++;
-  pctx.mctx.nw++;
-  if (stock_file == NULL) {
-    rv = reinterpret_cast<FILE*>(new fake_file(stripped));
-    logf(LOG_WARN, "VPIS IS OPENING MULTIPLE PLFSDIR FILES SIMULTANEOUSLY!");
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->insert(rv);
-  } else {
-    assert(stock_file == &the_stock_file);
-    stock_file->reset(stripped);
-    rv = reinterpret_cast<FILE*>(stock_file);
-    stock_file = NULL;
+    check_names(fname, strlen(fname), 0, 1);
   }
+  /* min_nw and max_nw are derived from nw at the end of the epoch */
+  __sync_fetch_and_add(&pctx.mctx.nw, 1);
+  __sync_fetch_and_add(&num_open_files, 1);
 
-  pthread_mtx_unlock(&preload_mtx);
+  rv = reinterpret_cast<FILE*>(fake_file_get(stripped));
 
   return rv;
 }
@@ -2311,12 +2925,8 @@ int fputc(int character, FILE* stream) {
  * fclose.   returns EOF on error.
  */
 int fclose(FILE* stream) {
-  ssize_t n;
-  uint64_t off;
   const char* fname;
   size_t fname_len;
-  char* data;
-  size_t data_len;
   int rv;
 
   rv = pthread_once(&init_once, preload_init);
@@ -2329,7 +2939,6 @@ int fclose(FILE* stream) {
   fake_file* const ff = reinterpret_cast<fake_file*>(stream);
   fname = ff->file_name();
   assert(fname != NULL);
-  off = 0;
 
   /* check file path and remove parent directories */
   assert(pctx.len_plfsdir != 0 && pctx.plfsdir != NULL);
@@ -2340,65 +2949,10 @@ int fclose(FILE* stream) {
   /* obtain filename length */
   fname_len = strlen(fname);
 
-  if (pctx.paranoid_checks) {
-    if (pctx.particle_id_size != fname_len) {
-      ABORT("bad particle id size");
-    }
-    if (pctx.particle_size != ff->size()) {
-      ABORT("bad particle size");
-    }
-  }
-
-  if (pctx.sideio) {
-    if (IS_BYPASS_WRITE(pctx.mode)) {
-      /* empty */
-
-    } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-      assert(pctx.plfshdl != NULL);
-      n = deltafs_plfsdir_io_append(pctx.plfshdl, ff->data(), ff->size());
+  rv = ship_particle(fname, fname_len, ff->data(), ff->size());
 
-      if (n != ff->size()) {
-        ABORT("plfsdir sideio write failed");
-      }
-
-    } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
-      ABORT("not implemented");
-
-    } else {
-      ABORT("not implemented");
-    }
-
-    data_len = sizeof(off);
-    data = reinterpret_cast<char*>(&off);
-
-  } else {
-    data_len = ff->size();
-    data = ff->data();
-  }
-
-  if (!IS_BYPASS_SHUFFLE(pctx.mode)) {
-    rv = pctx.sh_udf->process(fname, fname_len, data, data_len, num_eps - 1);
-    if (rv) {
-      ABORT("plfsdir shuffler write failed");
-    }
-  } else {
-    rv = native_write(fname, fname_len, data, data_len, num_eps - 1);
-    if (rv) {
-      ABORT("plfsdir write failed");
-    }
-  }
-
-  pthread_mtx_lock(&preload_mtx);
-
-  if (ff == &the_stock_file) {
-    stock_file = &the_stock_file; /* to be reused*/
-  } else {
-    assert(pctx.isdeltafs != NULL);
-    pctx.isdeltafs->erase(stream);
-    delete ff;
-  }
-
-  pthread_mtx_unlock(&preload_mtx);
+  fake_file_put(ff);
+  __sync_fetch_and_sub(&num_open_files, 1);
 
   return rv;
 }
@@ -2556,29 +3110,26 @@ long ftell(FILE* stream) {
  * preload_write
  */
 int preload_write(const char* fname, unsigned char fname_len, char* data,
-                  unsigned char data_len, int epoch) {
-  int rv;
-  char path[PATH_MAX];
+                  unsigned int data_len, int epoch) {
+  write_lane* lane;
   ssize_t n;
-  int fd;
+  int rv;
 
   if (epoch == -1) {
     epoch = num_eps - 1;
   }
 
-  if (pctx.fake_data) {
-    memset(particle_buf, 0, sizeof(particle_buf));
-    // TODO
+  /* a fast peer may send writes before we sealed the previous epoch */
+  if (flusher != NULL && epoch > flusher->flushed + 1) {
+    flusher_wait(epoch - 1);
   }
 
-  pthread_mtx_lock(&write_mtx);
-  // FILE *f = fopen("/users/ankushj/dfs-exp/scripts/log.txt", "a+");
-
   if (pctx.paranoid_checks) {
     if (fname_len != strlen(fname)) {
       ABORT("bad particle filename length");
     }
-    if (fname_len != pctx.particle_id_size || data_len != pctx.particle_size) {
+    if (fname_len != pctx.particle_id_size ||
+        data_len != unsigned(pctx.particle_size)) {
       ABORT("bad particle format");
     }
     if (epoch != num_eps - 1) {
@@ -2586,17 +3137,25 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     }
   }
 
-  if (pctx.sampling) {
-    // fprintf(f, "sampling\n");
-    assert(pctx.smap != NULL);
+  assert(lanes != NULL);
+  if (num_lanes == 1) {
+    lane = &lanes[0];
+  } else {
+    lane = &lanes[pdlfs::xxhash32(fname, fname_len, 0) & (num_lanes - 1)];
+  }
+
+  pthread_mtx_lock(&lane->mtx);
+
+  if (pctx.sampling && fname_len == pctx.particle_id_size) {
     if (num_eps == 1) {
       /* during the initial epoch, we accept as many names as possible */
       if (getr(0, 1000000 - 1) < pctx.sthres) {
-        pctx.smap->insert(std::make_pair(fname, 1));
+        lane->smpls.insert(fname);
       }
     } else {
-      if (pctx.smap->count(fname) != 0) {
-        pctx.smap->at(fname)++;
+      int* const cnt = lane->smpls.find(fname);
+      if (cnt != NULL) {
+        (*cnt)++;
       }
     }
   }
@@ -2607,7 +3166,6 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     rv = 0; /* noop */
 
   } else if (IS_BYPASS_DELTAFS_NAMESPACE(pctx.mode)) {
-    // fprintf(f, "bypass dfs namespace\n");
     assert(pctx.plfshdl != NULL);
     n = deltafs_plfsdir_append(pctx.plfshdl, fname, epoch, data, data_len);
     if (n == data_len) {
@@ -2615,24 +3173,74 @@ int preload_write(const char* fname, unsigned char fname_len, char* data,
     }
 
   } else if (IS_BYPASS_DELTAFS(pctx.mode)) {
-    snprintf(path, sizeof(path), "%s/%s", pctx.local_root, fname);
-    fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
-
-    if (fd != -1) {
-      n = write(fd, data, data_len);
-      if (n == data_len) {
-        rv = 0;
-      }
-      close(fd);
+    assert(lane->llog != NULL);
+    if (lane->llog->append(fname, fname_len, data, data_len, epoch) == 0) {
+      rv = 0;
     }
 
   } else {
     ABORT("not implemented");
   }
 
-  // fclose(f);
-  pthread_mtx_unlock(&write_mtx);
+  pthread_mtx_unlock(&lane->mtx);
+
+  return rv;
+}
 
+/*
+ * preload_write_batch
+ */
+int preload_write_batch(const char* ids, const char* data, size_t n,
+                        int epoch) {
+  char fname[256];
+  std::string fdata;
+  size_t id_sz;
+  size_t data_sz;
+  int rv;
+
+  rv = pthread_once(&init_once, preload_init);
+  if (rv) ABORT("pthread_once");
+
+  if (pctx.len_plfsdir == 0) {
+    ABORT("plfsdir not configured");
+  }
+
+  if (epoch == -1) {
+    epoch = num_eps - 1;
+  }
+
+  id_sz = pctx.particle_id_size;
+  data_sz = pctx.particle_size;
+  if (id_sz >= sizeof(fname)) {
+    ABORT("bad particle format");
+  }
+
+  if (pctx.paranoid_checks) {
+    if (epoch != num_eps - 1) {
+      ABORT("bad epoch num");
+    }
+    check_names(ids, id_sz, id_sz, n);
+  }
+  __sync_fetch_and_add(&pctx.mctx.nw, n);
+
+  if (!IS_BYPASS_SHUFFLE(pctx.mode) && !pctx.sideio && !pctx.fake_data) {
+    rv = pctx.sh_udf->process_batch(ids, id_sz, data, data_sz, n, epoch);
+    if (rv) {
+      ABORT("plfsdir shuffler write failed");
+    }
+    return rv;
+  }
+
+  /* side io, fake data, and unshuffled writes go one particle at a time */
+  for (size_t i = 0; i < n; i++) {
+    memcpy(fname, ids + i * id_sz, id_sz);
+    fname[id_sz] = 0;
+    fdata.assign(data + i * data_sz, data_sz);
+    rv = ship_particle(fname, id_sz, &fdata[0], data_sz);
+    if (rv) {
+      break;
+    }
+  }
 
   return rv;
 }
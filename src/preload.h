@@ -45,6 +45,20 @@
  *    Bytes of each particle
  *  PRELOAD_Particle_extra_size
  *    Extra bytes for each particle
+ *  PRELOAD_Particle_schema
+ *    Fields of each particle (name:type[:offset][:le|be],...; default: vpic)
+ *  PRELOAD_Particle_schema_file
+ *    Path to a file holding the particle schema
+ *  PRELOAD_Fake_file_pool_size
+ *    Num of plfsdir files each thread may keep open without malloc
+ *  PRELOAD_Num_write_lanes
+ *    Num of concurrent plfsdir write lanes (default: num memtable partitions)
+ *  PRELOAD_Mpi_wait
+ *    Max millisecs to sleep between polls of an MPI async op
+ *  PRELOAD_Barrier_spin_us
+ *    Microsecs to spin on a barrier before backing off
+ *  PRELOAD_Barrier_yield
+ *    Yield the cpu to background threads while spinning on a barrier
  *  PRELOAD_Pthread_tap
  *    Rank# less than this will get their rusage tapped
  *  PRELOAD_Ignore_dirs (semicolon separated paths)
@@ -58,7 +72,7 @@
  *  PRELOAD_Bypass_deltafs_namespace
  *    Use deltafs light-wright plfsdir api
  *  PRELOAD_Bypass_deltafs
- *    Write to local file system
+ *    Write to append-only logs on the local file system
  *  PRELOAD_Bypass_write
  *    Make every write and mkdir an noop
  *  PRELOAD_Skip_mon
@@ -80,6 +94,10 @@
  *    Do not scan operating system or device settings
  *  PRELOAD_No_paranoid_checks
  *    Disable misc checks on vpic writes
+ *  PRELOAD_Paranoid_exact_names
+ *    Count name collisions exactly instead of via a bloom filter
+ *  PRELOAD_Name_filter_size
+ *    Bytes of the bloom filter used to detect name collisions
  *  PRELOAD_No_paranoid_barrier
  *    Disable MPI barriers at the beginning of an epoch
  *      and right before an epoch flush
@@ -91,12 +109,30 @@
  *      and right before a soft epoch flush
  *  PRELOAD_No_epoch_pre_flushing
  *    No soft epoch flush at the end of an epoch
+ *  PRELOAD_Async_epoch_flush
+ *    Pre-flush epochs in background while the app computes the next one,
+ *      regardless of PRELOAD_No_epoch_pre_flushing, and seal each when
+ *      the next one begins
  *  PRELOAD_Local_root
  *    Local file system root that backs deltafs
  *  PRELOAD_Testing
  *    Used by developers to debug code
+ *  PRELOAD_Trace_binary
+ *    Write per-particle testing traces as binary records (see bin_trace.h)
+ *  PRELOAD_Trace_ring_size
+ *    Num of binary trace records each thread may buffer (default: 64K)
  *  PRELOAD_Inject_fake_data
- *    Replace particle data with artificial data
+ *    Replace particle data with synthetic vpic particles
+ *  PRELOAD_Fake_data_dist
+ *    Momentum distribution of fake particles (maxwellian, powerlaw, skew)
+ *  PRELOAD_Fake_data_uth
+ *    Thermal momentum spread of fake particles
+ *  PRELOAD_Fake_data_tail_frac
+ *    Fraction of fake particles in the power-law tail or the beam
+ *  PRELOAD_Fake_data_tail_index
+ *    Power-law index of the tail
+ *  PRELOAD_Fake_data_skew
+ *    Beam drift (in thermal spreads) added per epoch
  *  PRELOAD_Sample_threshold
  *    Num samples per 1 million input particles
  *  PRELOAD_Skip_sampling
@@ -165,7 +201,30 @@
  * preload_write: ship data to fs.
  */
 extern int preload_write(const char* id, unsigned char id_sz, char* data,
-                         unsigned char data_len, int epoch);
+                         unsigned int data_len, int epoch);
+
+/*
+ * preload_write_batch: ingest a batch of particles without going through
+ * the fopen/fwrite/fclose interception. this is for simulation codes that
+ * link against us directly.
+ *
+ * ids holds n fixed-size particle ids (PRELOAD_Particle_id_size bytes
+ * each, no null terminator required) and data holds n fixed-size particle
+ * records (PRELOAD_Particle_size bytes each). particles are shuffled and
+ * written exactly as if each had been written to its own file under the
+ * plfsdir. epoch must be the current epoch or -1. the caller is still
+ * expected to opendir/closedir the plfsdir to delimit epochs.
+ *
+ * return 0 on success, or EOF on errors.
+ */
+extern int preload_write_batch(const char* ids, const char* data, size_t n,
+                               int epoch);
+
+/*
+ * Default size of the bloom filter used to detect particle name
+ * collisions. Good for ~8M particles per rank at ~0.1% false positives.
+ */
+#define DEFAULT_NAME_FILTER_SIZE (16 << 20)
 
 /*
  * Default hash key size for encoding file names.
@@ -31,12 +31,14 @@
 #include "preload_internal.h"
 
 #include <mpi.h>
+#include <sched.h>
+#include <unistd.h>
 
 /* The global preload context */
 preload_ctx_t pctx = {0};
 
 int exotic_write(const char* fname, unsigned char fname_len, char* data,
-                 unsigned char data_len, int epoch) {
+                 unsigned int data_len, int epoch) {
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
@@ -46,15 +48,19 @@ int exotic_write(const char* fname, unsigned char fname_len, char* data,
 }
 
 int native_write(const char* fname, unsigned char fname_len, char* data,
-                 unsigned char data_len, int epoch) {
+                 unsigned int data_len, int epoch) {
   int rv;
 
   rv = preload_write(fname, fname_len, data, data_len, epoch);
-  pctx.mctx.nlw++;
+  /* may also be called by the local delivery thread */
+  __sync_fetch_and_add(&pctx.mctx.nlw, 1);
 
   return rv;
 }
 
+/* first sleep after PRELOAD_Barrier stops spinning */
+#define BARRIER_MIN_BACKOFF 16 /* micros */
+
 namespace {
 struct barrier_state {
   double time;
@@ -62,9 +68,22 @@ struct barrier_state {
 };
 }  // namespace
 
+/*
+ * PRELOAD_Barrier: an MPI barrier that first spins on MPI_Test for up to
+ * pctx.barrier_spin micros, optionally yielding the cpu to our background
+ * shuffle and compaction threads, and then sleeps between tests with
+ * exponential backoff capped at pctx.mpi_wait millis. short barriers thus
+ * return almost immediately while long ones do not burn cpu.
+ */
 void PRELOAD_Barrier(MPI_Comm comm) {
   struct barrier_state start;
   struct barrier_state min;
+  uint64_t spin_start;
+  uint64_t spin_end;
+  uint64_t sleep_end;
+  useconds_t backoff;
+  useconds_t max_backoff;
+  unsigned long long polls;
   double dura;
   int ok;
 
@@ -77,9 +96,35 @@ void PRELOAD_Barrier(MPI_Comm comm) {
     MPI_Status status;
     MPI_Request req;
     MPI_Iallreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm, &req);
-    for (ok = 0; !ok;) {
-      usleep(pctx.mpi_wait * 1000);
+    spin_start = now_micros();
+    polls = 1;
+    MPI_Test(&req, &ok, &status);
+    spin_end = spin_start;
+    while (!ok && spin_end - spin_start < pctx.barrier_spin) {
+      if (pctx.barrier_yield) sched_yield();
       MPI_Test(&req, &ok, &status);
+      spin_end = now_micros();
+      polls++;
+    }
+    max_backoff = useconds_t(pctx.mpi_wait) * 1000;
+    backoff = (max_backoff < BARRIER_MIN_BACKOFF) ? max_backoff
+                                                  : BARRIER_MIN_BACKOFF;
+    while (!ok) {
+      usleep(backoff);
+      MPI_Test(&req, &ok, &status);
+      polls++;
+      backoff = (backoff > max_backoff / 2) ? max_backoff : 2 * backoff;
+    }
+    sleep_end = now_micros();
+
+    pctx.barrier_stat.num++;
+    pctx.barrier_stat.polls += polls;
+    pctx.barrier_stat.spin_micros += spin_end - spin_start;
+    pctx.barrier_stat.sleep_micros += sleep_end - spin_end;
+    if (pctx.my_rank == 0 && pctx.verbose) {
+      logf(LOG_INFO, "barrier waited: spin %s, backoff %s, %llu polls",
+           pretty_dura(spin_end - spin_start).c_str(),
+           pretty_dura(sleep_end - spin_end).c_str(), polls);
     }
   } else {
     MPI_Allreduce(&start, &min, 1, MPI_DOUBLE_INT, MPI_MINLOC, comm);
@@ -38,6 +38,7 @@
 #include <deltafs/deltafs_api.h>
 
 #include "common.h"
+#include "particle_schema.h"
 #include "preload_mon.h"
 #include "preload_shuffle.h"
 
@@ -48,6 +49,15 @@
 #include <vector>
 
 class shuffler_udf; // forward declaration
+class name_filter;
+
+/* time spent in PRELOAD_Barrier, by phase */
+typedef struct barrier_stat {
+  unsigned long long num;          /* num of barriers */
+  unsigned long long polls;        /* num of MPI_Test calls */
+  unsigned long long spin_micros;  /* time spent spinning */
+  unsigned long long sleep_micros; /* time spent backing off */
+} barrier_stat_t;
 
 /*
  * preload context:
@@ -68,6 +78,8 @@ typedef struct preload_ctx {
   size_t len_log_home;  /* strlen */
 
   int mpi_wait; /* number of millisecs to wait for MPI async operations */
+  uint64_t barrier_spin; /* micros to spin before barriers back off */
+  int barrier_yield;     /* yield the cpu while spinning */
   int mode;     /* operating mode */
 
   int paranoid_checks; /* various checks on vpic writes */
@@ -83,6 +95,8 @@ typedef struct preload_ctx {
   int pre_flushing_wait;
   int pre_flushing_sync;
 
+  int async_epoch_flush; /* flush epochs in a background thread */
+
   int my_rank; /* my MPI world rank */
   int comm_sz; /* my MPI world size */
   int my_cpus; /* num of available cpu cores */
@@ -92,6 +106,8 @@ typedef struct preload_ctx {
   int particle_extra_size; /* extra padding for each particle shuffled */
   int particle_id_size;
 
+  particle_schema_t pschema; /* layout of each particle */
+
   /* since some ranks may be sender-only, so we have a dedicated MPI
    * communicator formed specifically for receivers. note that each receiver may
    * be a sender as well. for those sender-only ranks, their receiver
@@ -116,10 +132,9 @@ typedef struct preload_ctx {
   int papi_set; /* opaque event set descriptor */
 #endif
 
-  std::set<FILE*>* isdeltafs;    /* open files owned by deltafs */
   std::set<std::string>* fnames; /* used for checking unique file names */
-
-  std::map<std::string, int>* smap; /* sampled particle names */
+  name_filter* nfilter;          /* ... or approximately the same */
+  int paranoid_exact_names;      /* use fnames instead of nfilter */
 
   int sthres;   /* sample threshold (num samples per 1 million input names) */
   int sampling; /* enable particle name sampling */
@@ -139,6 +154,8 @@ typedef struct preload_ctx {
 
   mon_ctx_t mctx; /* mon stats */
 
+  barrier_stat_t barrier_stat; /* accumulated barrier waits */
+
   /* temporary mon stats */
   uint64_t last_sys_usage_snaptime;
   struct rusage last_sys_usage;
@@ -156,6 +173,7 @@ typedef struct preload_ctx {
   int verbose;       /* verbose mode */
 
   FILE* trace;
+  int trace_bin; /* per-particle traces go to bin_trace instead */
 
 } preload_ctx_t;
 
@@ -166,17 +184,18 @@ extern preload_ctx_t pctx;
  * return 0 on success, or EOF on errors.
  */
 extern int exotic_write(const char* fname, unsigned char fname_len, char* data,
-                        unsigned char data_len, int epoch);
+                        unsigned int data_len, int epoch);
 
 /*
  * native_write: perform a direct local write.
  * return 0 on success, or EOF on errors.
  */
 extern int native_write(const char* fname, unsigned char fname_len, char* data,
-                        unsigned char data_len, int epoch);
+                        unsigned int data_len, int epoch);
 
 /*
  * PRELOAD_Barrier: perform a collective barrier operation
- * on the give communicator.
+ * on the give communicator. spins briefly, then backs off
+ * exponentially up to pctx.mpi_wait millis.
  */
 extern void PRELOAD_Barrier(MPI_Comm comm);
@@ -31,6 +31,11 @@
 #include <arpa/inet.h>
 #include <assert.h>
 #include <ifaddrs.h>
+#include <limits.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <vector>
 
 #include "preload_internal.h"
 #include "preload_mon.h"
@@ -44,8 +49,11 @@
 #include <mercury_config.h>
 #include <pdlfs-common/xxhash.h>
 
+#include "bin_trace.h"
 #include "common.h"
 #include "loadbalance_util.h"
+#include "local_deliv.h"
+#include "partitioner.h"
 
 namespace {
 const char* shuffle_prepare_sm_uri(char* buf, const char* proto) {
@@ -93,6 +101,115 @@ const char* shuffle_prepare_sm_uri(char* buf, const char* proto) {
 }
 }  // namespace
 
+namespace {
+/* return the socket of the cpu we are running on, or 0 if unknown */
+int shuffle_my_socket() {
+  char path[100];
+  int socket = 0;
+  const int cpu = sched_getcpu();
+  if (cpu < 0) return 0;
+  snprintf(path, sizeof(path),
+           "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+  FILE* f = fopen(path, "r");
+  if (f != NULL) {
+    if (fscanf(f, "%d", &socket) != 1) socket = 0;
+    fclose(f);
+  }
+  return socket;
+}
+
+/* obtain a communicator of all ranks on our node */
+MPI_Comm shuffle_node_comm() {
+  MPI_Comm comm;
+  int rv;
+#if MPI_VERSION >= 3
+  rv = MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0,
+                           MPI_INFO_NULL, &comm);
+#else
+  char host[HOST_NAME_MAX + 1];
+  if (gethostname(host, sizeof(host)) != 0) ABORT("gethostname");
+  host[HOST_NAME_MAX] = 0;
+  const int color = static_cast<int>(
+      pdlfs::xxhash32(host, strlen(host), 0) & 0x7fffffff);
+  rv = MPI_Comm_split(MPI_COMM_WORLD, color, pctx.my_rank, &comm);
+#endif
+  if (rv != MPI_SUCCESS) {
+    ABORT("MPI_Comm_split_type");
+  }
+  return comm;
+}
+
+struct node_rank {
+  int socket;
+  int rank; /* world rank */
+  bool operator<(const node_rank& other) const {
+    return socket < other.socket ||
+           (socket == other.socket && rank < other.rank);
+  }
+};
+}  // namespace
+
+/*
+ * shuffle_build_recv_map: pick ctx->receivers_per_node receivers on each
+ * node and map every rank to a receiver on its own node.
+ *
+ * ranks on a node are ordered by socket and then by rank, and receivers are
+ * picked at evenly spaced positions of that order. receivers are thus
+ * spread over sockets in proportion to the ranks each socket has. the
+ * order is rotated to start at the lowest rank of the node, so world rank
+ * 0 is always a receiver. each sender is mapped to a receiver on its own
+ * socket when there is one, and senders are spread evenly over receivers.
+ */
+void shuffle_build_recv_map(shuffle_ctx_t* ctx) {
+  MPI_Comm comm = shuffle_node_comm();
+  int size;
+  MPI_Comm_size(comm, &size);
+
+  node_rank me;
+  me.socket = shuffle_my_socket();
+  me.rank = pctx.my_rank;
+  std::vector<node_rank> ranks(size);
+  MPI_Allgather(&me, 2, MPI_INT, &ranks[0], 2, MPI_INT, comm);
+  MPI_Comm_free(&comm);
+  std::sort(ranks.begin(), ranks.end());
+
+  const int k = std::min(ctx->receivers_per_node, size);
+  size_t first = 0;
+  for (size_t i = 1; i < ranks.size(); i++) {
+    if (ranks[i].rank < ranks[first].rank) first = i;
+  }
+  std::vector<int> recvs; /* indexes into ranks */
+  for (int i = 0; i < k; i++) {
+    recvs.push_back(int((first + size_t(i) * size / k) % size));
+  }
+
+  /* map myself to a receiver on my socket, round-robin by my position */
+  int my_recv = -1;
+  size_t my_pos = 0;
+  for (size_t i = 0; i < ranks.size(); i++) {
+    if (ranks[i].rank == pctx.my_rank) my_pos = i;
+  }
+  std::vector<int> local; /* receivers on my socket */
+  for (size_t i = 0; i < recvs.size(); i++) {
+    if (size_t(recvs[i]) == my_pos) my_recv = pctx.my_rank;
+    if (ranks[recvs[i]].socket == me.socket) local.push_back(recvs[i]);
+  }
+  if (my_recv == -1) {
+    const std::vector<int>& pool = local.empty() ? recvs : local;
+    my_recv = ranks[pool[my_pos % pool.size()]].rank;
+  }
+
+  ctx->recv_map = static_cast<int*>(malloc(sizeof(int) * pctx.comm_sz));
+  if (ctx->recv_map == NULL) ABORT("malloc");
+  MPI_Allgather(&my_recv, 1, MPI_INT, ctx->recv_map, 1, MPI_INT,
+                MPI_COMM_WORLD);
+  ctx->num_receivers = 0;
+  for (int i = 0; i < pctx.comm_sz; i++) {
+    if (ctx->recv_map[i] == i) ctx->num_receivers++;
+  }
+  assert(ctx->recv_map[0] == 0);
+}
+
 const char* shuffle_prepare_uri(char* buf) {
   int family;
   int port;
@@ -307,6 +424,9 @@ void shuffle_epoch_start(shuffle_ctx_t* ctx) {
 
 void shuffle_epoch_end(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
+  if (ctx->ldq != NULL) {
+    local_deliv_drain(ctx->ldq);
+  }
   if (ctx->type == SHUFFLE_XN) {
     xn_shuffler_epoch_end(static_cast<xn_ctx_t*>(ctx->rep));
   } else {
@@ -318,41 +438,113 @@ void shuffle_epoch_end(shuffle_ctx_t* ctx) {
   }
 }
 
-int shuffle_data_target(shuffle_ctx_t* ctx, const char* buf, unsigned int buf_sz, const char* data_buf, unsigned int data_buf_sz) {
-  int world_sz;
-  unsigned long target;
-  int rv;
+namespace {
+template <typename P>
+inline int shuffle_data_target(shuffle_ctx_t* ctx, const char* fname,
+                               const char* data, int src) {
+  if (shuffle_world_sz(ctx) != 1) {
+    return P::target(ctx, fname, data, src);
+  } else {
+    return shuffle_receiver(ctx, shuffle_rank(ctx));
+  }
+}
+}  // namespace
 
+int shuffle_data_target(shuffle_ctx_t* ctx, const char* buf,
+                        unsigned int buf_sz, const char* data_buf,
+                        unsigned int data_buf_sz, int src) {
   assert(ctx != NULL);
   assert(buf_sz >= ctx->fname_len);
 
-  world_sz = shuffle_world_sz(ctx);
+  switch (ctx->partitioner) {
+    case SHUFFLE_PARTITION_HASH:
+      return shuffle_data_target<partitioner::hash>(ctx, buf, data_buf, src);
+    case SHUFFLE_PARTITION_SPATIAL_X:
+      return shuffle_data_target<partitioner::spatial<0> >(
+          ctx, buf, data_buf, src);
+    case SHUFFLE_PARTITION_SPATIAL_Y:
+      return shuffle_data_target<partitioner::spatial<1> >(
+          ctx, buf, data_buf, src);
+    case SHUFFLE_PARTITION_SPATIAL_Z:
+      return shuffle_data_target<partitioner::spatial<2> >(
+          ctx, buf, data_buf, src);
+    case SHUFFLE_PARTITION_ZORDER:
+      return shuffle_data_target<partitioner::zorder>(ctx, buf, data_buf, src);
+    default:
+      return shuffle_data_target<partitioner::energy>(ctx, buf, data_buf, src);
+  }
+}
 
-  if (world_sz != 1) {
-    // if (IS_BYPASS_PLACEMENT(pctx.mode)) {
-      // rv = pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
-    // } else {
-      // assert(ctx->chp != NULL);
-      // ch_placement_find_closest(
-          // ctx->chp, pdlfs::xxhash64(buf, ctx->fname_len, 0), 1, &target);
-      double energy = compute_energy(data_buf);
-      rv = binary_search(ctx->dest_bins, pctx.comm_sz, energy);
-      if (rv < 0) {
-        printf("-----------> PROBLEM PROBLEM SHUFFLE_TARGET -1 PROBLEM <-------\n");
-      }
-      // printf("--> Moving particle %s with energy %lf to %d/%d\n", buf, energy, rv, rv & ctx->receiver_mask);
-      //rv = static_cast<int>(target);
-    // }
+int shuffle_record_target(shuffle_ctx_t* ctx, char* rec, unsigned int rec_sz,
+                          int src) {
+  assert(ctx != NULL);
+  if (rec_sz < ctx->fname_len + 1 + ctx->data_len) {
+    ABORT("bad shuffle record size");
+  }
+  return shuffle_data_target(ctx, rec, ctx->fname_len,
+                             rec + ctx->fname_len + 1, ctx->data_len, src);
+}
+
+int shuffle_needs_bins(shuffle_ctx_t* ctx) {
+  assert(ctx != NULL);
+  return ctx->partitioner == SHUFFLE_PARTITION_ENERGY;
+}
+
+int shuffle_energy_target(shuffle_ctx_t* ctx, double energy, int* bin) {
+  assert(ctx != NULL);
+  assert(ctx->has_bins);
+  if (shuffle_world_sz(ctx) != 1) {
+    const int nbins = pctx.comm_sz;
+    const int b = partitioner::energy::clamp(
+        binary_search(ctx->dest_bins, nbins, energy), nbins);
+    if (bin != NULL) *bin = b;
+    return shuffle_receiver(ctx, b);
   } else {
-    rv = shuffle_rank(ctx);
+    if (bin != NULL) *bin = 0;
+    return shuffle_receiver(ctx, shuffle_rank(ctx));
+  }
+}
+
+void shuffle_energy_targets(shuffle_ctx_t* ctx, const double* energies,
+                            int* targets, size_t n, int* bins) {
+  assert(ctx != NULL);
+  assert(ctx->has_bins);
+  if (shuffle_world_sz(ctx) != 1) {
+    const int nbins = pctx.comm_sz;
+    binary_search_batch(ctx->dest_bins, nbins, energies, targets, n);
+    for (size_t i = 0; i < n; i++) {
+      const int b = partitioner::energy::clamp(targets[i], nbins);
+      if (bins != NULL) bins[i] = b;
+      targets[i] = shuffle_receiver(ctx, b);
+    }
+  } else {
+    const int rank = shuffle_receiver(ctx, shuffle_rank(ctx));
+    for (size_t i = 0; i < n; i++) {
+      if (bins != NULL) bins[i] = 0;
+      targets[i] = rank;
+    }
   }
+}
 
-  return (rv & ctx->receiver_mask);
+namespace {
+/* jump consistent hash by Lamping and Veach */
+int jump_hash(uint64_t key, int num_buckets) {
+  int64_t b = -1;
+  int64_t j = 0;
+  while (j < num_buckets) {
+    b = j;
+    key = key * 2862933555777941757ULL + 1;
+    j = int64_t(double(b + 1) *
+                (double(1LL << 31) / double((key >> 33) + 1)));
+  }
+  return static_cast<int>(b);
 }
+}  // namespace
 
 int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   int world_sz;
   unsigned long target;
+  uint64_t h;
   int rv;
 
   assert(ctx != NULL);
@@ -363,6 +555,13 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
   if (world_sz != 1) {
     if (IS_BYPASS_PLACEMENT(pctx.mode)) {
       rv = pdlfs::xxhash32(buf, ctx->fname_len, 0) % world_sz;
+    } else if (ctx->placement == SHUFFLE_PLACEMENT_TABLE) {
+      assert(ctx->ptable != NULL);
+      h = pdlfs::xxhash64(buf, ctx->fname_len, 0);
+      rv = static_cast<int>(ctx->ptable[h >> (64 - ctx->ptable_bits)]);
+    } else if (ctx->placement == SHUFFLE_PLACEMENT_JUMP) {
+      h = pdlfs::xxhash64(buf, ctx->fname_len, 0);
+      rv = jump_hash(h, world_sz);
     } else {
       assert(ctx->chp != NULL);
       ch_placement_find_closest(
@@ -373,15 +572,21 @@ int shuffle_target(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz) {
     rv = shuffle_rank(ctx);
   }
 
-  return (rv & ctx->receiver_mask);
+  return shuffle_receiver(ctx, rv);
 }
 
 namespace {
-void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
+void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                          int epoch, int src, int dst) {
   const int h = pdlfs::xxhash32(buf, buf_sz, 0);
 
-  if (src != dst || ctx->force_rpc) {
+  if (pctx.trace_bin) {
+    if (src != dst || ctx->force_rpc) {
+      bin_trace_event(TRACE_SH, src, dst, epoch, h, buf_sz);
+    } else {
+      bin_trace_event(TRACE_LO, src, dst, epoch, h, buf_sz);
+    }
+  } else if (src != dst || ctx->force_rpc) {
     fprintf(pctx.trace, "[SH] %u bytes (ep=%d) r%d >> r%d (xx=%08x)\n", buf_sz,
             epoch, src, dst, h);
   } else {
@@ -393,28 +598,29 @@ void shuffle_write_debug(shuffle_ctx_t* ctx, char* buf, unsigned char buf_sz,
 }
 }  // namespace
 
-int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
-                  int epoch) {
-  char buf[255];
-  int peer_rank;
+int shuffle_write_to(shuffle_ctx_t* ctx, const char* fname,
+                     unsigned char fname_len, char* data,
+                     unsigned int data_len, int epoch, int peer_rank) {
+  char tmp[256];
+  char* buf;
   int rank;
   int rv;
 
   assert(ctx == &pctx.sctx);
-  assert(ctx->extra_data_len + ctx->data_len < 255 - ctx->fname_len - 1);
   if (ctx->fname_len != fname_len) ABORT("bad filename len");
   if (ctx->data_len != data_len) ABORT("bad data len");
 
-  unsigned char base_sz = 1 + fname_len + data_len;
-  unsigned char buf_sz = base_sz + ctx->extra_data_len;
+  unsigned int base_sz = 1 + fname_len + data_len;
+  unsigned int buf_sz = base_sz + ctx->extra_data_len;
+  assert(buf_sz <= SHUFFLE_MAX_RECORD);
+  /* most particles fit on the stack */
+  buf = (buf_sz <= sizeof(tmp)) ? tmp : static_cast<char*>(malloc(buf_sz));
+  if (buf == NULL) ABORT("malloc");
   memcpy(buf, fname, fname_len);
   buf[fname_len] = 0;
   memcpy(buf + fname_len + 1, data, data_len);
   if (buf_sz != base_sz) memset(buf + base_sz, 0, buf_sz - base_sz);
-
-  // peer_rank = shuffle_target(ctx, buf, buf_sz);
-  peer_rank = shuffle_data_target(ctx, fname, fname_len, data, data_len);
+  if (ctx->map_versioned) buf[base_sz] = ctx->map_version;
 
   rank = shuffle_rank(ctx);
 
@@ -424,18 +630,63 @@ int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
 
   /* bypass rpc if target is local */
   if (peer_rank == rank && !ctx->force_rpc) {
-    rv = native_write(fname, fname_len, data, data_len, epoch);
-    return rv;
-  }
-
-  if (ctx->type == SHUFFLE_XN) {
-    xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), buf, buf_sz, epoch,
-                        peer_rank, rank);
+    __sync_fetch_and_add(&ctx->nrecv, 1);
+    if (ctx->map_versioned) {
+      __sync_fetch_and_add(&ctx->nrecv_ver[ctx->map_version], 1);
+    }
+    if (ctx->ldq != NULL) {
+      rv = local_deliv_enqueue(ctx->ldq, fname, data, epoch);
+    } else {
+      rv = native_write(fname, fname_len, data, data_len, epoch);
+    }
   } else {
-    nn_shuffler_enqueue(buf, buf_sz, epoch, peer_rank, rank);
+    if (ctx->type == SHUFFLE_XN) {
+      xn_shuffler_enqueue(static_cast<xn_ctx_t*>(ctx->rep), buf, buf_sz,
+                          epoch, peer_rank, rank);
+    } else {
+      nn_shuffler_enqueue(buf, buf_sz, epoch, peer_rank, rank);
+    }
+    rv = 0;
   }
 
-  return 0;
+  if (buf != tmp) free(buf);
+  return rv;
+}
+
+namespace {
+template <typename P>
+inline int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
+                         unsigned char fname_len, char* data,
+                         unsigned int data_len, int epoch) {
+  return shuffle_write_to(ctx, fname, fname_len, data, data_len, epoch,
+                          shuffle_data_target<P>(ctx, fname, data,
+                                                 pctx.my_rank));
+}
+}  // namespace
+
+int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
+                  unsigned char fname_len, char* data, unsigned int data_len,
+                  int epoch) {
+  switch (ctx->partitioner) {
+    case SHUFFLE_PARTITION_HASH:
+      return shuffle_write<partitioner::hash>(ctx, fname, fname_len, data,
+                                              data_len, epoch);
+    case SHUFFLE_PARTITION_SPATIAL_X:
+      return shuffle_write<partitioner::spatial<0> >(ctx, fname, fname_len,
+                                                     data, data_len, epoch);
+    case SHUFFLE_PARTITION_SPATIAL_Y:
+      return shuffle_write<partitioner::spatial<1> >(ctx, fname, fname_len,
+                                                     data, data_len, epoch);
+    case SHUFFLE_PARTITION_SPATIAL_Z:
+      return shuffle_write<partitioner::spatial<2> >(ctx, fname, fname_len,
+                                                     data, data_len, epoch);
+    case SHUFFLE_PARTITION_ZORDER:
+      return shuffle_write<partitioner::zorder>(ctx, fname, fname_len, data,
+                                                data_len, epoch);
+    default:
+      return shuffle_write<partitioner::energy>(ctx, fname, fname_len, data,
+                                                data_len, epoch);
+  }
 }
 
 namespace {
@@ -443,10 +694,14 @@ void shuffle_handle_debug(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
                           int epoch, int src, int dst) {
   const int h = pdlfs::xxhash32(buf, buf_sz, 0);
 
-  fprintf(pctx.trace,
-          "[RM] %u bytes (ep=%d) r%d << r%d "
-          "(xx=%08x)\n",
-          buf_sz, epoch, dst, src, h);
+  if (pctx.trace_bin) {
+    bin_trace_event(TRACE_RM, src, dst, epoch, h, buf_sz);
+  } else {
+    fprintf(pctx.trace,
+            "[RM] %u bytes (ep=%d) r%d << r%d "
+            "(xx=%08x)\n",
+            buf_sz, epoch, dst, src, h);
+  }
 }
 }  // namespace
 
@@ -457,6 +712,14 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
   ctx = &pctx.sctx;
   if (buf_sz != ctx->extra_data_len + ctx->data_len + ctx->fname_len + 1)
     ABORT("unexpected incoming shuffle request size");
+  __sync_fetch_and_add(&ctx->nrecv, 1);
+  if (ctx->map_versioned) {
+    const unsigned char v = static_cast<unsigned char>(
+        buf[ctx->fname_len + 1 + ctx->data_len]);
+    if (v < SHUFFLE_MAX_MAP_VERSIONS) {
+      __sync_fetch_and_add(&ctx->nrecv_ver[v], 1);
+    }
+  }
   rv = exotic_write(buf, ctx->fname_len, buf + ctx->fname_len + 1,
                     ctx->data_len, epoch);
 
@@ -468,6 +731,23 @@ int shuffle_handle(shuffle_ctx_t* ctx, char* buf, unsigned int buf_sz,
 
 void shuffle_finalize(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
+  if (ctx->ldq != NULL) {
+    unsigned long long sum[2];
+    unsigned long long n[2];
+    local_deliv_destroy(ctx->ldq);
+    n[0] = ctx->ldq->nq;
+    n[1] = ctx->ldq->ninline;
+    MPI_Reduce(n, sum, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (pctx.my_rank == 0 && (sum[0] + sum[1]) != 0) {
+      logf(LOG_INFO,
+           "[local] %s particles queued for delivery, %s written inline "
+           "(%.2f%%) as queues were full",
+           pretty_num(sum[0]).c_str(), pretty_num(sum[1]).c_str(),
+           100.0 * sum[1] / (sum[0] + sum[1]));
+    }
+    free(ctx->ldq);
+    ctx->ldq = NULL;
+  }
   if (ctx->type == SHUFFLE_XN && ctx->rep != NULL) {
     xn_ctx_t* rep = static_cast<xn_ctx_t*>(ctx->rep);
     xn_shuffler_destroy(rep);
@@ -635,6 +915,21 @@ void shuffle_finalize(shuffle_ctx_t* ctx) {
     ch_placement_finalize(ctx->chp);
     ctx->chp = NULL;
   }
+
+  if (ctx->ptable != NULL) {
+    free(ctx->ptable);
+    ctx->ptable = NULL;
+  }
+  if (ctx->recv_map != NULL) {
+    free(ctx->recv_map);
+    ctx->recv_map = NULL;
+  }
+
+  if (ctx->stage != NULL) {
+    free(ctx->stage);
+    ctx->stage = NULL;
+    ctx->stage_cap = ctx->stage_num = 0;
+  }
 }
 
 namespace {
@@ -646,6 +941,30 @@ unsigned char TOUCHAR(int input) {
 }
 }  // namespace
 
+namespace {
+/*
+ * shuffle_build_ptable: precompute placement for every hash bucket by
+ * looking up the midpoint of the bucket on the ring. every rank builds
+ * the same table, so lookups agree across ranks.
+ */
+void shuffle_build_ptable(shuffle_ctx_t* ctx) {
+  const size_t n = size_t(1) << ctx->ptable_bits;
+  const int shift = 64 - ctx->ptable_bits;
+  unsigned long target;
+
+  assert(ctx->chp != NULL);
+  ctx->ptable = static_cast<uint32_t*>(malloc(n * sizeof(uint32_t)));
+  if (ctx->ptable == NULL) {
+    ABORT("malloc");
+  }
+  for (size_t i = 0; i < n; i++) {
+    const uint64_t mid = (uint64_t(i) << shift) | (uint64_t(1) << (shift - 1));
+    ch_placement_find_closest(ctx->chp, mid, 1, &target);
+    ctx->ptable[i] = static_cast<uint32_t>(target);
+  }
+}
+}  // namespace
+
 void shuffle_init(shuffle_ctx_t* ctx) {
   const char* proto;
   const char* env;
@@ -656,10 +975,11 @@ void shuffle_init(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
 
   ctx->fname_len = TOUCHAR(pctx.particle_id_size);
-  ctx->extra_data_len = TOUCHAR(pctx.particle_extra_size);
-  ctx->data_len = pctx.sideio ? 8 : TOUCHAR(pctx.particle_size);
-  if (ctx->extra_data_len + ctx->data_len > 255 - ctx->fname_len - 1)
-    ABORT("bad shuffle conf: id + data exceeds 255 bytes");
+  ctx->extra_data_len = pctx.particle_extra_size;
+  ctx->data_len = pctx.sideio ? 8 : pctx.particle_size;
+  if (size_t(ctx->extra_data_len) + ctx->data_len >
+      SHUFFLE_MAX_RECORD - ctx->fname_len - 1)
+    ABORT("bad shuffle conf: id + data exceeds max record size");
   if (ctx->fname_len == 0) {
     ABORT("bad shuffle conf: id size is zero");
   }
@@ -669,6 +989,161 @@ void shuffle_init(shuffle_ctx_t* ctx) {
          ctx->extra_data_len + ctx->data_len);
   }
 
+  env = maybe_getenv("SHUFFLE_Partitioner");
+  if (env == NULL) {
+    /* modulo placement only makes sense for the hash partitioner */
+    ctx->partitioner = IS_BYPASS_PLACEMENT(pctx.mode)
+                           ? SHUFFLE_PARTITION_HASH
+                           : SHUFFLE_PARTITION_ENERGY;
+  } else if (strcmp(env, "hash") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_HASH;
+  } else if (strcmp(env, "energy") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_ENERGY;
+  } else if (strcmp(env, "spatial_x") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_SPATIAL_X;
+  } else if (strcmp(env, "spatial_y") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_SPATIAL_Y;
+  } else if (strcmp(env, "spatial_z") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_SPATIAL_Z;
+  } else if (strcmp(env, "zorder") == 0) {
+    ctx->partitioner = SHUFFLE_PARTITION_ZORDER;
+  } else {
+    ABORT("bad shuffle partitioner");
+  }
+  if (ctx->partitioner != SHUFFLE_PARTITION_HASH) {
+    /* particles must hold the fields the partitioner reads */
+    const particle_schema_t* const s = &pctx.pschema;
+    const int ok = (ctx->partitioner == SHUFFLE_PARTITION_ENERGY)
+                       ? pschema_has_momentum(s)
+                       : pschema_has_position(s);
+    if (!ok || unsigned(s->size) > ctx->data_len) {
+      if (pctx.my_rank == 0) {
+        logf(LOG_WARN,
+             "particle schema lacks fields for the partitioner\n>>> "
+             "falling back to hash partitioning");
+      }
+      ctx->partitioner = SHUFFLE_PARTITION_HASH;
+    }
+  }
+  if (pctx.my_rank == 0) {
+    logf(LOG_INFO, "shuffle partitioner: %s",
+         ctx->partitioner == SHUFFLE_PARTITION_HASH     ? "hash"
+         : ctx->partitioner == SHUFFLE_PARTITION_ENERGY ? "energy"
+         : ctx->partitioner == SHUFFLE_PARTITION_ZORDER ? "zorder"
+                                                        : "spatial");
+  }
+  ctx->pivot_method = SHUFFLE_PIVOT_SAMPLE;
+  ctx->pivot_samples = DEFAULT_PIVOT_SAMPLES;
+  env = maybe_getenv("SHUFFLE_Pivot_method");
+  if (env != NULL) {
+    if (strcmp(env, "sample") == 0) {
+      ctx->pivot_method = SHUFFLE_PIVOT_SAMPLE;
+    } else if (strcmp(env, "gaussian") == 0) {
+      ctx->pivot_method = SHUFFLE_PIVOT_GAUSSIAN;
+    } else {
+      ABORT("bad shuffle pivot method");
+    }
+  }
+  env = maybe_getenv("SHUFFLE_Pivot_samples");
+  if (env != NULL && atoi(env) > 0) {
+    ctx->pivot_samples = atoi(env);
+  }
+  ctx->pivot_trigger = DEFAULT_PIVOT_TRIGGER;
+  ctx->pivot_trigger_us = 0;
+  env = maybe_getenv("SHUFFLE_Pivot_trigger");
+  if (env != NULL && atol(env) > 0) {
+    ctx->pivot_trigger = atol(env);
+  }
+  env = maybe_getenv("SHUFFLE_Pivot_trigger_ms");
+  if (env != NULL && atoi(env) > 0) {
+    ctx->pivot_trigger_us = uint64_t(atoi(env)) * 1000;
+  }
+  ctx->pivot_drift = DEFAULT_PIVOT_DRIFT;
+  env = maybe_getenv("SHUFFLE_Pivot_drift");
+  if (env != NULL) {
+    ctx->pivot_drift = atof(env);
+  }
+  ctx->rebalance_us = 0;
+  ctx->rebalance_rounds = DEFAULT_REBALANCE_ROUNDS;
+  ctx->rebalance_threshold = DEFAULT_REBALANCE_THRESHOLD;
+  env = maybe_getenv("SHUFFLE_Rebalance_ms");
+  if (env != NULL && atoi(env) > 0) {
+    ctx->rebalance_us = uint64_t(atoi(env)) * 1000;
+  }
+  env = maybe_getenv("SHUFFLE_Rebalance_rounds");
+  if (env != NULL) {
+    ctx->rebalance_rounds = atoi(env);
+    if (ctx->rebalance_rounds < 0) ctx->rebalance_rounds = 0;
+    if (ctx->rebalance_rounds > SHUFFLE_MAX_MAP_VERSIONS - 1)
+      ctx->rebalance_rounds = SHUFFLE_MAX_MAP_VERSIONS - 1;
+  }
+  env = maybe_getenv("SHUFFLE_Rebalance_threshold");
+  if (env != NULL && atof(env) > 1) {
+    ctx->rebalance_threshold = atof(env);
+  }
+  if (ctx->partitioner == SHUFFLE_PARTITION_ENERGY &&
+      ctx->rebalance_us != 0 && ctx->rebalance_rounds != 0) {
+    /* records carry their map version in an extra byte */
+    ctx->map_versioned = 1;
+    ctx->extra_data_len += 1;
+    if (size_t(ctx->extra_data_len) + ctx->data_len >
+        SHUFFLE_MAX_RECORD - ctx->fname_len - 1)
+      ABORT("bad shuffle conf: id + data exceeds max record size");
+  }
+  if (pctx.my_rank == 0 && ctx->partitioner == SHUFFLE_PARTITION_ENERGY) {
+    if (ctx->map_versioned) {
+      logf(LOG_INFO,
+           "energy bins refined every %s up to %d times per epoch "
+           "(threshold: %.2f)",
+           pretty_dura(ctx->rebalance_us).c_str(), ctx->rebalance_rounds,
+           ctx->rebalance_threshold);
+    }
+    logf(LOG_INFO, "energy pivots negotiated after %ld particles%s",
+         ctx->pivot_trigger,
+         ctx->pivot_trigger_us != 0 ? " or a timeout" : "");
+    if (ctx->pivot_drift > 0) {
+      logf(LOG_INFO, "energy pivots reused until they drift by %.4f",
+           ctx->pivot_drift);
+    }
+    if (ctx->pivot_method == SHUFFLE_PIVOT_GAUSSIAN) {
+      logf(LOG_INFO, "energy pivots: gaussian fit");
+    } else {
+      logf(LOG_INFO, "energy pivots: equi-depth from %d samples per rank",
+           ctx->pivot_samples);
+    }
+  }
+  if (ctx->partitioner >= SHUFFLE_PARTITION_SPATIAL_X) {
+    env = maybe_getenv("SHUFFLE_Partition_grid");
+    if (env == NULL || sscanf(env, "%d,%d,%d", &ctx->pgrid[0],
+                              &ctx->pgrid[1], &ctx->pgrid[2]) != 3) {
+      ABORT("spatial partitioning requires SHUFFLE_Partition_grid");
+    }
+    if (ctx->pgrid[0] <= 0 || ctx->pgrid[1] <= 0 || ctx->pgrid[2] <= 0) {
+      ABORT("bad shuffle partition grid");
+    }
+    ctx->pdomain[0] = ctx->pdomain[1] = ctx->pdomain[2] = 1;
+    env = maybe_getenv("SHUFFLE_Partition_domain");
+    if (env == NULL) {
+      /* local voxel indexes alone cannot tell ranks apart */
+      if (pctx.comm_sz > 1) {
+        ABORT("spatial partitioning requires SHUFFLE_Partition_domain");
+      }
+    } else if (sscanf(env, "%d,%d,%d", &ctx->pdomain[0], &ctx->pdomain[1],
+                      &ctx->pdomain[2]) != 3) {
+      ABORT("bad shuffle partition domain");
+    }
+    if (ctx->pdomain[0] <= 0 || ctx->pdomain[1] <= 0 ||
+        ctx->pdomain[2] <= 0 ||
+        ctx->pdomain[0] * ctx->pdomain[1] * ctx->pdomain[2] != pctx.comm_sz) {
+      ABORT("shuffle partition domain does not match comm size");
+    }
+    if (pctx.my_rank == 0) {
+      logf(LOG_INFO, "spatial partitioning: %dx%dx%d voxels on %dx%dx%d ranks",
+           ctx->pgrid[0], ctx->pgrid[1], ctx->pgrid[2], ctx->pdomain[0],
+           ctx->pdomain[1], ctx->pdomain[2]);
+    }
+  }
+
   ctx->receiver_rate = 1;
   ctx->receiver_mask = ~static_cast<unsigned int>(0);
   env = maybe_getenv("SHUFFLE_Recv_radix");
@@ -680,10 +1155,21 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       ctx->receiver_mask <<= n;
     }
   }
+  env = maybe_getenv("SHUFFLE_Recv_per_node");
+  if (env != NULL && atoi(env) > 0) {
+    ctx->receivers_per_node = atoi(env);
+    shuffle_build_recv_map(ctx);
+  }
   ctx->is_receiver = shuffle_is_rank_receiver(ctx, pctx.my_rank);
   if (pctx.my_rank == 0) {
-    logf(LOG_INFO, "%u shuffle senders per receiver\n>>> receiver mask is %#x",
-         ctx->receiver_rate, ctx->receiver_mask);
+    if (ctx->recv_map != NULL) {
+      logf(LOG_INFO, "%d shuffle receivers per node (%d in total)",
+           ctx->receivers_per_node, ctx->num_receivers);
+    } else {
+      logf(LOG_INFO,
+           "%u shuffle senders per receiver\n>>> receiver mask is %#x",
+           ctx->receiver_rate, ctx->receiver_mask);
+    }
   }
 
   env = maybe_getenv("SHUFFLE_Finalize_pause");
@@ -701,8 +1187,21 @@ void shuffle_init(shuffle_ctx_t* ctx) {
   if (is_envset("SHUFFLE_Force_rpc")) {
     ctx->force_rpc = 1;
   }
+  env = maybe_getenv("SHUFFLE_Local_deliv_queue");
+  if (env != NULL && atoi(env) > 0 && !ctx->force_rpc) {
+    ctx->ldq = static_cast<local_deliv_t*>(malloc(sizeof(local_deliv_t)));
+    if (ctx->ldq == NULL) ABORT("malloc");
+    local_deliv_init(ctx->ldq, size_t(atoi(env)), ctx->fname_len,
+                     ctx->data_len);
+  }
   if (pctx.my_rank == 0) {
-    if (!ctx->force_rpc) {
+    if (ctx->ldq != NULL) {
+      logf(LOG_INFO,
+           "shuffle force_rpc is OFF (will skip shuffle if addr is "
+           "local)\n>>> "
+           "local writes are queued to a delivery thread (%s slots)",
+           pretty_num(ctx->ldq->num_slots).c_str());
+    } else if (!ctx->force_rpc) {
       logf(LOG_WARN,
            "shuffle force_rpc is OFF (will skip shuffle if addr is "
            "local)\n>>> "
@@ -750,16 +1249,65 @@ void shuffle_init(shuffle_ctx_t* ctx) {
       proto = DEFAULT_PLACEMENT_PROTO;
     }
 
-    ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
-                                       0 /* hash seed */);
-    if (ctx->chp == NULL) {
-      ABORT("ch_init");
+    ctx->placement = SHUFFLE_PLACEMENT_CH;
+    if (strcmp(proto, "table") == 0) {
+      ctx->placement = SHUFFLE_PLACEMENT_TABLE;
+      proto = DEFAULT_PLACEMENT_PROTO; /* the ring behind the table */
+    } else if (strcmp(proto, "jump") == 0) {
+      ctx->placement = SHUFFLE_PLACEMENT_JUMP;
+    }
+
+    if (ctx->placement != SHUFFLE_PLACEMENT_JUMP) {
+      ctx->chp = ch_placement_initialize(proto, world_sz, vf /* vir factor */,
+                                         0 /* hash seed */);
+      if (ctx->chp == NULL) {
+        ABORT("ch_init");
+      }
+    }
+
+    if (ctx->placement == SHUFFLE_PLACEMENT_TABLE) {
+      env = maybe_getenv("SHUFFLE_Placement_table_bits");
+      if (env == NULL) {
+        ctx->ptable_bits = DEFAULT_PLACEMENT_TABLE_BITS;
+        while (ctx->ptable_bits < DEFAULT_PLACEMENT_TABLE_MAX_BITS &&
+               (size_t(1) << ctx->ptable_bits) <
+                   size_t(DEFAULT_PLACEMENT_TABLE_BUCKETS_PER_RANK) *
+                       world_sz) {
+          ctx->ptable_bits++;
+        }
+      } else {
+        ctx->ptable_bits = atoi(env);
+        if (ctx->ptable_bits < 1) ctx->ptable_bits = 1;
+        if (ctx->ptable_bits > MAX_PLACEMENT_TABLE_BITS)
+          ctx->ptable_bits = MAX_PLACEMENT_TABLE_BITS;
+      }
+      if (pctx.my_rank == 0 &&
+          (size_t(1) << ctx->ptable_bits) / world_sz <
+              MIN_PLACEMENT_TABLE_BUCKETS_PER_RANK) {
+        logf(LOG_WARN,
+             "placement table has only %s buckets per rank\n>>> "
+             "load across ranks may be uneven; "
+             "consider raising SHUFFLE_Placement_table_bits",
+             pretty_num((size_t(1) << ctx->ptable_bits) / world_sz).c_str());
+      }
+      shuffle_build_ptable(ctx);
+    }
+
+    if (pctx.my_rank == 0) {
+      if (ctx->placement == SHUFFLE_PLACEMENT_TABLE) {
+        logf(LOG_INFO, "placement: %s buckets over a %s ring (vf=%d)",
+             pretty_num(1ull << ctx->ptable_bits).c_str(), proto, vf);
+      } else if (ctx->placement == SHUFFLE_PLACEMENT_JUMP) {
+        logf(LOG_INFO, "placement: jump consistent hash");
+      } else {
+        logf(LOG_INFO, "placement: %s (vf=%d)", proto, vf);
+      }
     }
   }
 
   /* allocate memory for bins */
   printf("--> Allocate %d units of memory for bins\n", pctx.comm_sz);
-  ctx->dest_bins = (double *) malloc(sizeof(double)*pctx.comm_sz + 1);
+  ctx->dest_bins = (double *) malloc(sizeof(double) * (pctx.comm_sz + 1));
 
   if (pctx.my_rank == 0) {
     if (!IS_BYPASS_PLACEMENT(pctx.mode)) {
@@ -803,11 +1351,13 @@ void shuffle_init(shuffle_ctx_t* ctx) {
 
 int shuffle_is_everyone_receiver(shuffle_ctx_t* ctx) {
   assert(ctx != NULL);
+  if (ctx->recv_map != NULL) return ctx->num_receivers == pctx.comm_sz;
   return ctx->receiver_rate == 1;
 }
 
 int shuffle_is_rank_receiver(shuffle_ctx_t* ctx, int rank) {
   assert(ctx != NULL);
+  if (ctx->recv_map != NULL) return ctx->recv_map[rank] == rank;
   if (ctx->receiver_rate == 1) return 1;
   return (rank & ctx->receiver_mask) == rank;
 }
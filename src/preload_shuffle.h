@@ -37,13 +37,63 @@
  *    Use the three-hop shuffler instead of the default NN shuffler
  *  SHUFFLE_Force_rpc
  *    Send rpcs even if target is local
+ *  SHUFFLE_Local_deliv_queue
+ *    Num of particle slots in a queue that hands particles whose target is
+ *      local to a delivery thread (default: 0, write them inline)
  *  SHUFFLE_Placement_protocol
  *    Protocol name for initializing placement groups
- *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring
+ *      such as static_modulo, hash_spooky, hash_lookup3, xor, as well as ring.
+ *      "table" precomputes a ring into a hash-bucket lookup table, and
+ *      "jump" uses jump consistent hashing
+ *  SHUFFLE_Placement_table_bits
+ *    Log2 of the number of buckets in the placement table, at most 24
+ *      (default: the smallest giving 1024 buckets per rank, between 16
+ *      and 20 so that the table stays cache-resident)
+ *  SHUFFLE_Partitioner
+ *    How particles are mapped to receivers: hash, energy (default),
+ *      spatial_x, spatial_y, spatial_z, or zorder
+ *  SHUFFLE_Pivot_method
+ *    How energy bins are computed: sample (default, equi-depth bins from
+ *      sampled energies) or gaussian (fit a normal distribution)
+ *  SHUFFLE_Pivot_samples
+ *    Num of energy samples each rank contributes to the pivots (default: 64)
+ *  SHUFFLE_Pivot_drift
+ *    Max KS distance between sampled energies and the bins of the previous
+ *      epoch before the bins are renegotiated (default: 0.05; 0 renegotiates
+ *      every epoch)
+ *  SHUFFLE_Pivot_trigger
+ *    Num of particles a rank stages before it starts negotiating energy bins
+ *      (default: 500; ranks that stage fewer join at the end of the epoch)
+ *  SHUFFLE_Pivot_trigger_ms
+ *    Millisecs into an epoch after which a rank starts negotiating energy
+ *      bins regardless of how many particles it has staged (default: off)
+ *  SHUFFLE_Rebalance_ms
+ *    Millisecs between rounds of refining energy bins within an epoch
+ *      (default: 0, bins are fixed for the whole epoch)
+ *  SHUFFLE_Rebalance_rounds
+ *    Max num of refining rounds per epoch (default: 4, at most 15)
+ *  SHUFFLE_Rebalance_threshold
+ *    Max/avg bin load above which a round publishes refined bins
+ *      (default: 1.2)
+ *  SHUFFLE_Energy_tap_dir
+ *    Directory to record the id, time, and energy of every shuffled
+ *      particle into, as binary records (see energy_tap.h)
+ *  SHUFFLE_Energy_tap_chunk_size
+ *    Bytes each thread buffers before records are handed to the tap
+ *      writer (default: 1MiB)
+ *  SHUFFLE_Partition_grid (nx,ny,nz)
+ *    Voxel grid dimensions (ghosts included) of each rank's local subdomain
+ *      for spatial partitioners
+ *  SHUFFLE_Partition_domain (px,py,pz)
+ *    Rank grid the global domain is split into, with rank = x + px*(y + py*z)
+ *      as in vpic's topology; required by spatial partitioners when there
+ *      is more than one rank (default: 1,1,1)
  *  SHUFFLE_Virtual_factor
  *    Virtual factor used by nodes in a placement group
  *  SHUFFLE_Recv_radix
  *    Number of senders (1**radix) per receiver
+ *  SHUFFLE_Recv_per_node
+ *    Number of receivers per node, spread across sockets (overrides radix)
  *  SHUFFLE_Finalize_pause
  *    Number of secs to sleep after releasing the shuffle instance
  *      for shuffle bg threads to complete shutdown
@@ -51,9 +101,94 @@
 #pragma once
 
 #include <stddef.h>
-#include <map>
+#include <stdint.h>
 #include <string>
 
+/*
+ * a shuffled write is encoded as a record:
+ *
+ *   id (fname_len bytes), '\0', data (data_len bytes),
+ *   zero padding (extra_data_len bytes)
+ *
+ * when energy bins may change within an epoch, the first padding byte
+ * holds the version of the bins the record was routed with.
+ *
+ * records batched into a single message are each prefixed by their size
+ * encoded as a varint: 7 bits per byte, low bits first, with the high bit
+ * set on all but the last byte.
+ */
+#define SHUFFLE_MAX_VARINT_LEN 5
+#define SHUFFLE_MAX_RECORD (1u << 20) /* 1MB */
+
+/* encode v at dst and return a pointer to the byte after it */
+inline char* shuffle_encode_varint(char* dst, uint32_t v) {
+  unsigned char* p = reinterpret_cast<unsigned char*>(dst);
+  while (v >= 128) {
+    *p++ = static_cast<unsigned char>(v | 128);
+    v >>= 7;
+  }
+  *p++ = static_cast<unsigned char>(v);
+  return reinterpret_cast<char*>(p);
+}
+
+/* return the number of bytes needed to encode v */
+inline size_t shuffle_varint_length(uint32_t v) {
+  size_t n = 1;
+  while (v >= 128) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+/*
+ * decode a varint from [p, limit) into *v and return a pointer to the byte
+ * after it, or NULL if the input is truncated or malformed.
+ */
+inline const char* shuffle_decode_varint(const char* p, const char* limit,
+                                         uint32_t* v) {
+  uint32_t result = 0;
+  for (uint32_t shift = 0; shift <= 28 && p < limit; shift += 7) {
+    const uint32_t byte = static_cast<unsigned char>(*p++);
+    result |= (byte & 127) << shift;
+    if ((byte & 128) == 0) {
+      *v = result;
+      return p;
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Default num of energy samples each rank sends for pivot negotiation.
+ */
+#define DEFAULT_PIVOT_SAMPLES 64
+
+/*
+ * Default num of particles staged before joining pivot negotiation.
+ */
+#define DEFAULT_PIVOT_TRIGGER 500
+
+/*
+ * Default max drift of energy bins reused across epochs.
+ */
+#define DEFAULT_PIVOT_DRIFT 0.05
+
+/*
+ * Default bytes of energy tap records buffered per thread.
+ */
+#define DEFAULT_ENERGY_TAP_CHUNK (1 << 20)
+
+/*
+ * Default max num of bin refining rounds per epoch.
+ */
+#define DEFAULT_REBALANCE_ROUNDS 4
+
+/*
+ * Default max/avg bin load tolerated before bins are refined.
+ */
+#define DEFAULT_REBALANCE_THRESHOLD 1.2
+
 typedef struct shuffle_ctx {
   /* _sorted array_ of energy bins on the basis of which 
    * shuffle_target should decide destination 
@@ -65,14 +200,58 @@ typedef struct shuffle_ctx {
    * for shuffle_target computation
    */
   bool has_bins;
-  /* temporary buffer to store writes while nodes negotiate load balancing*/
-  // vector<string> temp_buffer;
-  std:: map<std::string, std::string> temp_buffer;
+  /* writes staged while nodes negotiate load balancing. records are
+   * fixed-size (epoch, fname + \0, data) and kept in arrival order in a
+   * single arena that only grows when it is full */
+  char* stage;
+  size_t stage_rec_sz;
+  size_t stage_num; /* num of records staged */
+  size_t stage_cap; /* max records before the arena must grow */
+  /* how dest_bins are negotiated for the energy partitioner */
+  int pivot_method;
+#define SHUFFLE_PIVOT_SAMPLE 0 /* default */
+#define SHUFFLE_PIVOT_GAUSSIAN 1
+  int pivot_samples; /* energies each rank contributes to the pivots */
+  /* a rank joins the negotiation after staging pivot_trigger particles,
+   * or pivot_trigger_us into the epoch if that is not 0 */
+  long pivot_trigger;
+  uint64_t pivot_trigger_us;
+  /* bins are kept across epochs until they drift by more than this */
+  double pivot_drift;
+  /* particles received by this rank in the current epoch */
+  uint64_t nrecv;
+  /* bins refined within an epoch (SHUFFLE_Rebalance_ms) */
+  uint64_t rebalance_us;
+  int rebalance_rounds;
+  double rebalance_threshold;
+  int map_versioned; /* records carry map_version */
+  unsigned char map_version; /* version of dest_bins in this epoch */
+#define SHUFFLE_MAX_MAP_VERSIONS 16
+  /* particles received in the current epoch per map version */
+  uint64_t nrecv_ver[SHUFFLE_MAX_MAP_VERSIONS];
 
   /* internal shuffle impl */
   void* rep;
   /* consistent hash context */
   struct ch_placement_instance* chp;
+  /* particle partitioner */
+  int partitioner;
+#define SHUFFLE_PARTITION_HASH 0
+#define SHUFFLE_PARTITION_ENERGY 1
+#define SHUFFLE_PARTITION_SPATIAL_X 2
+#define SHUFFLE_PARTITION_SPATIAL_Y 3
+#define SHUFFLE_PARTITION_SPATIAL_Z 4
+#define SHUFFLE_PARTITION_ZORDER 5
+  int pgrid[3]; /* voxel grid for spatial partitioners */
+  int pdomain[3]; /* rank grid the global domain is divided into */
+  /* placement method */
+  int placement;
+#define SHUFFLE_PLACEMENT_CH 0 /* default: ch-placement lookups */
+#define SHUFFLE_PLACEMENT_TABLE 1
+#define SHUFFLE_PLACEMENT_JUMP 2
+  /* (hash >> (64 - ptable_bits)) -> rank, precomputed from chp */
+  uint32_t* ptable;
+  int ptable_bits;
   /* whether shuffle should never be bypassed
    * even when destination is local. it is often necessary to
    * avoid bypassing the shuffle. this is because the main thread
@@ -80,16 +259,23 @@ typedef struct shuffle_ctx {
    * is bypassed and destination is local. so there is a chance where the main
    * thread is blocked and cannot go send more writes. */
   int force_rpc;
+  /* when not NULL, local particles are written by a delivery thread
+   * instead of the main thread, without going through rpc */
+  struct local_deliv* ldq;
   /* number of secs to sleep after releasing the shuffle instance so
    * shuffle bg threads can complete shutdown in the meantime. */
   int finalize_pause;
   unsigned int receiver_rate; /* only 1/receiver_rate ranks are receivers */
   /* (rank & receiver_mask) -> receiver_rank */
   unsigned int receiver_mask;
+  /* if not NULL, recv_map[rank] -> receiver_rank, used instead of the mask */
+  int* recv_map;
+  int receivers_per_node;
+  int num_receivers;
   int is_receiver;
   unsigned char fname_len;
-  unsigned char extra_data_len;
-  unsigned char data_len;
+  unsigned int extra_data_len;
+  unsigned int data_len;
   /* shuffle type */
   int type;
 #define SHUFFLE_NN 0 /* default */
@@ -105,6 +291,12 @@ const char* shuffle_prepare_uri(char* buf);
 /* return 0 if some ranks are sender-only, 1 otherwise. */
 int shuffle_is_everyone_receiver(shuffle_ctx_t* ctx);
 
+/* return the receiver that takes particles destined to a given rank. */
+inline int shuffle_receiver(const shuffle_ctx_t* ctx, int rank) {
+  if (ctx->recv_map != NULL) return ctx->recv_map[rank];
+  return static_cast<int>(rank & ctx->receiver_mask);
+}
+
 /* return 0 if a specific rank is not a receiver, 1 otherwise. */
 int shuffle_is_rank_receiver(shuffle_ctx_t* ctx, int rank);
 
@@ -126,9 +318,19 @@ int shuffle_world_sz(shuffle_ctx_t* ctx);
  * return 0 on success, or EOF or errors.
  */
 int shuffle_write(shuffle_ctx_t* ctx, const char* fname,
-                  unsigned char fname_len, char* data, unsigned char data_len,
+                  unsigned char fname_len, char* data, unsigned int data_len,
                   int epoch);
 
+/*
+ * shuffle_write_to: shuffle_write to a destination already chosen by the
+ * caller, such as one returned by shuffle_energy_targets().
+ *
+ * return 0 on success, or EOF or errors.
+ */
+int shuffle_write_to(shuffle_ctx_t* ctx, const char* fname,
+                     unsigned char fname_len, char* data,
+                     unsigned int data_len, int epoch, int peer_rank);
+
 /*
  * shuffle_epoch_start: perform necessary flushes at the
  * beginning of an epoch.
@@ -174,10 +376,32 @@ void shuffle_pause(shuffle_ctx_t* ctx);
 void shuffle_resume(shuffle_ctx_t* ctx);
 
 /*
- * shuffle_target: shuffle data like shuffle_target, buf
- * include shuffle data in the target computation
+ * shuffle_data_target: return the shuffle destination of a particle written
+ * at rank src as chosen by the configured partitioner.
+ */
+int shuffle_data_target(shuffle_ctx_t* ctx, const char* buf, unsigned int buf_sz, const char* data_buf, unsigned int data_buf_sz, int src);
+
+/*
+ * shuffle_record_target: shuffle_data_target for an encoded record.
+ */
+int shuffle_record_target(shuffle_ctx_t* ctx, char* rec, unsigned int rec_sz, int src);
+
+/* return 1 if the partitioner needs energy bins to be negotiated */
+int shuffle_needs_bins(shuffle_ctx_t* ctx);
+
+/*
+ * shuffle_energy_target: return the shuffle destination of a particle of
+ * the given energy. bins must have been negotiated. if bin is not NULL,
+ * the index of the energy bin is stored in *bin.
+ */
+int shuffle_energy_target(shuffle_ctx_t* ctx, double energy,
+                          int* bin = NULL);
+
+/*
+ * shuffle_energy_targets: shuffle_energy_target for n particles at once.
  */
-int shuffle_data_target(shuffle_ctx_t* ctx, const char* buf, unsigned int buf_sz, const char* data_buf, unsigned int data_buf_sz);
+void shuffle_energy_targets(shuffle_ctx_t* ctx, const double* energies,
+                            int* targets, size_t n, int* bins = NULL);
 
 /*
  * shuffle_target: return the shuffle destination for a given req.
@@ -0,0 +1,175 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "sample_table.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <pdlfs-common/xxhash.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "common.h"
+
+/* slots are probed in groups of this many */
+#define GROUP_SIZE 16
+
+/* empty control byte; used slots always have their top bit set */
+#define CTRL_EMPTY 0
+
+namespace {
+inline uint8_t hash_tag(uint64_t h) {
+  return static_cast<uint8_t>(0x80 | (h >> 57));
+}
+
+/* return a bit mask of the bytes in a 16-byte group equal to b */
+inline unsigned match_group(const uint8_t* group, uint8_t b) {
+#if defined(__SSE2__)
+  const __m128i ctrl = _mm_load_si128(reinterpret_cast<const __m128i*>(group));
+  return static_cast<unsigned>(
+      _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(char(b)))));
+#else
+  unsigned mask = 0;
+  for (int i = 0; i < GROUP_SIZE; i++) {
+    mask |= unsigned(group[i] == b) << i;
+  }
+  return mask;
+#endif
+}
+}  // namespace
+
+sample_table::sample_table()
+    : ctrl_(NULL), keys_(NULL), counts_(NULL), key_size_(0), cap_(0), num_(0) {}
+
+sample_table::~sample_table() {
+  free(ctrl_);
+  free(keys_);
+  free(counts_);
+}
+
+void sample_table::init(size_t key_size, size_t capacity) {
+  size_t cap = GROUP_SIZE;
+  while (cap < capacity) cap <<= 1;
+  key_size_ = key_size;
+  cap_ = cap;
+  num_ = 0;
+  /* the control bytes must be 16-byte aligned for group loads */
+  if (posix_memalign(reinterpret_cast<void**>(&ctrl_), GROUP_SIZE, cap_) != 0)
+    ABORT("posix_memalign");
+  memset(ctrl_, CTRL_EMPTY, cap_);
+  keys_ = static_cast<char*>(malloc(cap_ * key_size_));
+  counts_ = static_cast<int*>(malloc(cap_ * sizeof(int)));
+  if (keys_ == NULL || counts_ == NULL) {
+    ABORT("malloc");
+  }
+}
+
+/*
+ * lookup: return the slot holding key, or the first empty slot on the
+ * key's probe sequence if the key is not there. the table is never full.
+ */
+size_t sample_table::lookup(const char* key, uint64_t h, bool* found) const {
+  const uint8_t tag = hash_tag(h);
+  size_t g = h & (cap_ - 1) & ~size_t(GROUP_SIZE - 1);
+  for (;;) {
+    const uint8_t* const group = ctrl_ + g;
+    unsigned m = match_group(group, tag);
+    while (m != 0) {
+      const size_t i = g + __builtin_ctz(m);
+      if (memcmp(keys_ + i * key_size_, key, key_size_) == 0) {
+        *found = true;
+        return i;
+      }
+      m &= m - 1;
+    }
+    m = match_group(group, CTRL_EMPTY);
+    if (m != 0) {
+      *found = false;
+      return g + __builtin_ctz(m);
+    }
+    g = (g + GROUP_SIZE) & (cap_ - 1);
+  }
+}
+
+void sample_table::grow() {
+  uint8_t* const old_ctrl = ctrl_;
+  char* const old_keys = keys_;
+  int* const old_counts = counts_;
+  const size_t old_cap = cap_;
+  bool found;
+
+  init(key_size_, old_cap << 1);
+  for (size_t i = 0; i < old_cap; i++) {
+    if (old_ctrl[i] != CTRL_EMPTY) {
+      const char* const key = old_keys + i * key_size_;
+      const uint64_t h = pdlfs::xxhash64(key, key_size_, 0);
+      const size_t j = lookup(key, h, &found);
+      ctrl_[j] = hash_tag(h);
+      memcpy(keys_ + j * key_size_, key, key_size_);
+      counts_[j] = old_counts[i];
+      num_++;
+    }
+  }
+
+  free(old_ctrl);
+  free(old_keys);
+  free(old_counts);
+}
+
+int sample_table::insert(const char* key) {
+  bool found;
+  /* keep the load factor under 7/8 */
+  if ((num_ + 1) * 8 > cap_ * 7) {
+    grow();
+  }
+  const uint64_t h = pdlfs::xxhash64(key, key_size_, 0);
+  const size_t i = lookup(key, h, &found);
+  if (found) {
+    return 0;
+  }
+  ctrl_[i] = hash_tag(h);
+  memcpy(keys_ + i * key_size_, key, key_size_);
+  counts_[i] = 1;
+  num_++;
+  return 1;
+}
+
+int* sample_table::find(const char* key) {
+  bool found;
+  if (num_ == 0) {
+    return NULL;
+  }
+  const uint64_t h = pdlfs::xxhash64(key, key_size_, 0);
+  const size_t i = lookup(key, h, &found);
+  return found ? &counts_[i] : NULL;
+}
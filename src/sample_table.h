@@ -0,0 +1,84 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * sample_table.h  compact open-addressing table for sampled particle names.
+ *
+ * names are fixed-size and stored inline, next to a per-name counter. each
+ * slot also has a one-byte control tag (0 for empty, otherwise 0x80 | 7
+ * bits of the name's hash). slots are probed 16 at a time by matching
+ * the tag against a whole group of control bytes, which is done with SSE2
+ * when available. names are never removed.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+class sample_table {
+ public:
+  sample_table();
+  ~sample_table();
+
+  /* must be called once before use. capacity is rounded up as needed */
+  void init(size_t key_size, size_t capacity);
+
+  /* insert a name with a count of 1. return 0 if the name was already in */
+  int insert(const char* key);
+
+  /* return a pointer to the count of a name, or NULL if not found */
+  int* find(const char* key);
+
+  /* number of names stored */
+  size_t size() const { return num_; }
+
+  /* for walking all slots: key_at() and count_at() are only
+   * meaningful for slots where used() returns true */
+  size_t capacity() const { return cap_; }
+  bool used(size_t i) const { return ctrl_[i] != 0; }
+  const char* key_at(size_t i) const { return keys_ + i * key_size_; }
+  int count_at(size_t i) const { return counts_[i]; }
+
+ private:
+  size_t lookup(const char* key, uint64_t h, bool* found) const;
+  void grow();
+
+  uint8_t* ctrl_; /* one control byte per slot */
+  char* keys_;    /* inline names, key_size_ bytes per slot */
+  int* counts_;   /* per-name counters */
+  size_t key_size_;
+  size_t cap_; /* num of slots, a power of 2 and a multiple of 16 */
+  size_t num_; /* num of used slots */
+
+  /* no copying allowed */
+  sample_table(const sample_table&);
+  void operator=(const sample_table&);
+};
@@ -4,14 +4,24 @@
 
 #include "shuffler_udf.h"
 #include "loadbalance_util.h"
+#include "energy_tap.h"
 #include <cstdio>
 #include <cmath>
+#include <climits>
 
 shuffler_udf ::shuffler_udf() {
   pctx = NULL;
+  pthread_mutex_init(&mtx, NULL);
+  checking_drift = false;
+  repivot = false;
+  cur_epoch = 0;
+  tap = false;
+  tap_energy = false;
+  time_field = -1;
 }
 
 shuffler_udf ::~shuffler_udf() {
+  pthread_mutex_destroy(&mtx);
   printf("bye world\n");
 }
 
@@ -25,6 +35,11 @@ void shuffler_udf ::init(preload_ctx_t *pctx_arg) {
     }
   }
   shuffle_init(&pctx->sctx);
+  pivot_init(&this->pivots, MPI_COMM_WORLD);
+  if (pctx->sctx.map_versioned) {
+    rebalance_init(&this->rebal, MPI_COMM_WORLD, pctx->comm_sz);
+  }
+  open_tap();
   /* ensures all peers have the shuffle ready */
   PRELOAD_Barrier(MPI_COMM_WORLD);
   if (pctx->my_rank == 0) {
@@ -50,15 +65,62 @@ void shuffler_udf ::init(preload_ctx_t *pctx_arg) {
   return;
 }
 
-int shuffler_udf ::process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch) {
+/*
+ * open_tap: start recording the energy of every particle we route if
+ * SHUFFLE_Energy_tap_dir is set.
+ */
+void shuffler_udf ::open_tap() {
+  const char *dir = maybe_getenv("SHUFFLE_Energy_tap_dir");
+  if (dir == NULL || dir[0] == 0) {
+    return;
+  }
+  size_t chunk_sz = DEFAULT_ENERGY_TAP_CHUNK;
+  const char *env = maybe_getenv("SHUFFLE_Energy_tap_chunk_size");
+  if (env != NULL && atoi(env) > 0) {
+    chunk_sz = size_t(atoi(env));
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/energy-tap.bin.%d", dir, pctx->my_rank);
+  energy_tap_open(path, pctx->my_rank, pctx->sctx.fname_len, chunk_sz);
+  this->tap = true;
+  /* energies are only computed for routing by the energy partitioner */
+  this->tap_energy = !shuffle_needs_bins(&pctx->sctx) &&
+                     pschema_has_momentum(&pctx->pschema);
+  this->time_field = pschema_find(&pctx->pschema, "time");
+  if (pctx->my_rank == 0) {
+    logf(LOG_INFO,
+         "tapping particle energies to %s/energy-tap.bin.* (%s chunks)", dir,
+         pretty_size(chunk_sz).c_str());
+  }
+}
+
+int shuffler_udf ::process(const char* fname, unsigned char fname_len, char* data, unsigned int data_len, int epoch) {
   assert(pctx);
-  float f[10];
-  memcpy(f, data, 40);
 
-  double energy = compute_energy(f[5], f[6], f[7]);
-  this->running_total += energy;
-  this->running_square += (energy * energy);
+  /* only the energy partitioner is sure to have momentum in the schema */
+  const int needs_bins = shuffle_needs_bins(&pctx->sctx);
+  double energy = 0;
+  if (needs_bins || this->tap_energy) {
+    energy = compute_energy(data);
+  }
+
+  /* dump threads may get here at the same time */
+  pthread_mtx_lock(&this->mtx);
+  if (needs_bins) {
+    this->running_total += energy;
+    this->running_square += (energy * energy);
+  }
+  int rv = process_one(fname, fname_len, data, data_len, epoch, energy);
+  pthread_mtx_unlock(&this->mtx);
+
+  return rv;
+}
 
+/*
+ * process_one: shuffle a particle whose energy (if needed) has already
+ * been computed and added to the running sums.
+ */
+int shuffler_udf ::process_one(const char* fname, unsigned char fname_len, char* data, unsigned int data_len, int epoch, double energy) {
   this->running_num++;
 
   // this->running_px += f[5];
@@ -71,130 +133,344 @@ int shuffler_udf ::process(const char* fname, unsigned char fname_len, char* dat
   // this->running_pz2 += (f[7] * f[7]);
 
   int rv;
-  if (pctx->sctx.has_bins) {
-    // printf("--> safe shuffle write at rank %d\n", pctx->my_rank);
+  if (!shuffle_needs_bins(&pctx->sctx)) {
     rv = shuffle_write(&pctx->sctx, fname, fname_len, data, data_len, epoch);
+  } else if (pctx->sctx.has_bins) {
+    // printf("--> safe shuffle write at rank %d\n", pctx->my_rank);
+    if (this->checking_drift && this->pivots.state == PIVOT_IDLE) {
+      this->samples.push_back(energy);
+    }
+    int bin;
+    const int target = shuffle_energy_target(&pctx->sctx, energy, &bin);
+    if (pctx->sctx.map_versioned) {
+      rebalance_count(&this->rebal, bin, energy);
+    }
+    rv = shuffle_write_to(&pctx->sctx, fname, fname_len, data, data_len,
+                          epoch, target);
   } else {
     // printf("--> writing %s to buffer, rank %d\n", fname, pctx->my_rank);
+    this->samples.push_back(energy);
     rv = buffer_write(&pctx->sctx, fname, fname_len, data, data_len, epoch);
   }
-  // printf("------- particle %s -------\n", fname);
-  // printf("step*dt: %f\n", f[0]);
-  // printf("pdx: %f, dy: %f, dz: %f\n", f[1], f[2], f[3]);
-  // printf("id: %d\n", (int) f[4]);
-  // printf("pux: %f, uy: %f, uz: %f\n", f[5], f[6], f[7]);
-  // printf("charge: %d\n", (int) f[8]);
-  // printf("tag: %d\n", (long int) f[9]);
-  //fprintf(this->dump_file, "!!step: %f, name: %s, traj: %f %f %f, ener: %f %f %f\n", f[0], fname, f[1], f[2], f[3], f[5], f[6], f[7]);
-  fprintf(this->dump_file, "fname: %s, s: %f, e: %lf\n", fname, f[0], energy);
-
-  if (this->running_num == 500) {
-    double all_total = 0;
-    double all_square = 0;
-
-    // double all_px = 0;
-    // double all_px2 = 0;
-
-    // double all_py = 0;
-    // double all_py2 = 0;
-
-    // double all_pz = 0;
-    // double all_pz2 = 0;
-
-    long int all_num = 0;
-    MPI_Reduce(const_cast<double *>(&this->running_total), 
-        &all_total, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    MPI_Reduce(const_cast<double *>(&this->running_square), 
-        &all_square, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    // MPI_Reduce(const_cast<double *>(&this->running_px), 
-        // &all_px, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    // MPI_Reduce(const_cast<double *>(&this->running_px2), 
-        // &all_px2, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    // MPI_Reduce(const_cast<double *>(&this->running_py), 
-        // &all_py, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    // MPI_Reduce(const_cast<double *>(&this->running_py2), 
-        // &all_py2, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    // MPI_Reduce(const_cast<double *>(&this->running_pz), 
-        // &all_pz, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-    // MPI_Reduce(const_cast<double *>(&this->running_pz2), 
-        // &all_pz2, 1, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    MPI_Reduce(const_cast<long int *>(&this->running_num), 
-        &all_num, 1, MPI_LONG, MPI_SUM, 0, MPI_COMM_WORLD);
-
-    if (this->pctx->my_rank == 0) {
-      printf("---> Post Reduce at rank 0: %lf %lf %ld\n", all_total, all_square, all_num);
+  if (this->tap) {
+    tap_particle(fname, data, epoch, energy);
+  }
+
+  if (shuffle_needs_bins(&pctx->sctx) && !pctx->sctx.has_bins) {
+    if (this->pivots.state == PIVOT_IDLE && pivots_due()) {
+      start_pivots();
     }
+    if (this->pivots.state != PIVOT_IDLE &&
+        pivot_test(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz)) {
+      if (install_pivots() != 0) {
+        rv = EOF;
+      }
+    }
+  } else if (shuffle_needs_bins(&pctx->sctx)) {
+    if (this->checking_drift) {
+      poll_drift();
+    }
+    if (pctx->sctx.map_versioned && (this->running_num & 63) == 0) {
+      poll_rebalance();
+    }
+  }
 
-    MPI_Bcast(&all_total, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    MPI_Bcast(&all_square, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+  return rv;
+}
 
-    // MPI_Bcast(&all_px, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    // MPI_Bcast(&all_px2, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+/*
+ * pivots_due: return true if we have staged enough particles, or staged
+ * them for long enough, to join the negotiation of the energy bins.
+ * without MPI-3 the negotiation blocks, so it is only done at epoch end
+ * where every rank is sure to join.
+ */
+bool shuffler_udf ::pivots_due() {
+#if MPI_VERSION >= 3
+  const shuffle_ctx_t *const sctx = &pctx->sctx;
+  if (this->running_num >= sctx->pivot_trigger) {
+    return true;
+  }
+  if (sctx->pivot_trigger_us != 0 && (this->running_num & 63) == 0) {
+    return now_micros() - this->epoch_begin >= sctx->pivot_trigger_us;
+  }
+#endif
+  return false;
+}
 
-    // MPI_Bcast(&all_py, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    // MPI_Bcast(&all_py2, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+void shuffler_udf ::start_pivots() {
+  pivot_start(&this->pivots, pctx->sctx.pivot_method,
+              this->samples.empty() ? NULL : &this->samples[0],
+              this->samples.size(), pctx->sctx.pivot_samples);
+}
 
-    // MPI_Bcast(&all_pz, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
-    // MPI_Bcast(&all_pz2, 1, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+/*
+ * poll_drift: join the drift check of the bins reused from the previous
+ * epoch once it is due, and collect its result once it is done.
+ */
+void shuffler_udf ::poll_drift() {
+  if (this->pivots.state == PIVOT_IDLE && pivots_due()) {
+    pivot_drift_start(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz,
+                      this->samples.empty() ? NULL : &this->samples[0],
+                      this->samples.size());
+  }
+  if (this->pivots.state != PIVOT_IDLE &&
+      pivot_test(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz)) {
+    finish_drift();
+  }
+}
 
-    MPI_Bcast(&all_num, 1, MPI_LONG, 0, MPI_COMM_WORLD);
+/*
+ * finish_drift: decide whether the next epoch may keep the current bins.
+ */
+void shuffler_udf ::finish_drift() {
+  this->checking_drift = false;
+  this->repivot = this->pivots.drift > pctx->sctx.pivot_drift;
+  if (pctx->my_rank == 0) {
+    logf(LOG_INFO, "energy bins drifted by %.4f (threshold %.4f)%s",
+         this->pivots.drift, pctx->sctx.pivot_drift,
+         this->repivot ? ", renegotiating next epoch" : "");
+  }
+}
 
-    printf("---> Post Reduce at all: %lf %lf %ld\n", all_total, all_square, all_num);
-    // printf("---> Px px2: %lf %lf\n", all_px, all_px2);
-    // printf("---> Py py2: %lf %lf\n", all_py, all_py2);
-    // printf("---> Pz pz2: %lf %lf\n", all_pz, all_pz2);
+/*
+ * poll_rebalance: start the next round of refining the bins once it is
+ * due, or collect the result of the round in flight. particles routed
+ * from now on use the latest map version.
+ */
+void shuffler_udf ::poll_rebalance() {
+  shuffle_ctx_t *const sctx = &pctx->sctx;
+  if (this->rebal.in_flight) {
+    if (rebalance_test(&this->rebal, sctx->dest_bins,
+                       sctx->rebalance_threshold, 0)) {
+      sctx->map_version = (unsigned char)(this->rebal.maps.size() - 1);
+    }
+  } else if (this->rebal.rounds_started < sctx->rebalance_rounds) {
+#if MPI_VERSION >= 3 /* otherwise a round would block the write path */
+    const uint64_t due =
+        uint64_t(this->rebal.rounds_started + 1) * sctx->rebalance_us;
+    if (now_micros() - this->epoch_begin >= due) {
+      rebalance_start(&this->rebal);
+    }
+#endif
+  }
+}
 
-    double mu = all_total / all_num;
-    double sigma2 = (all_square / all_num) - (mu * mu);
-    double sigma = sqrt(sigma2);
+/*
+ * finish_rebalance: run the rounds we have not joined yet so that every
+ * rank ends the epoch having joined the same number of rounds. rounds are
+ * agreed on over MPI_COMM_WORLD, not the rebalancing communicator, since
+ * some ranks may still have a round in flight there.
+ */
+void shuffler_udf ::finish_rebalance() {
+  shuffle_ctx_t *const sctx = &pctx->sctx;
+  int rounds = this->rebal.rounds_started;
+  MPI_Allreduce(MPI_IN_PLACE, &rounds, 1, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+  for (;;) {
+    if (this->rebal.in_flight) {
+      rebalance_test(&this->rebal, sctx->dest_bins, sctx->rebalance_threshold,
+                     1);
+      sctx->map_version = (unsigned char)(this->rebal.maps.size() - 1);
+    }
+    if (this->rebal.rounds_started >= rounds) {
+      break;
+    }
+    rebalance_start(&this->rebal);
+  }
+  if (pctx->my_rank == 0) {
+    logf(LOG_INFO, "energy bins refined %d times in %d rounds",
+         int(this->rebal.maps.size() - 1), rounds);
+  }
+}
 
-    // printf("---> Distribution looks like: %lf %lf\n", mu, sigma);
+/*
+ * dump_pivots: write the bins of every map version used in an epoch,
+ * along with how many particles each receiver got under each version,
+ * to PIVOTS-<epoch>.txt in the log home. a receiver holds the energies
+ * its bins covered in any version it received particles under.
+ * collective. must be called after receivers have been flushed.
+ */
+void shuffler_udf ::dump_pivots(int epoch) {
+  shuffle_ctx_t *const sctx = &pctx->sctx;
+  const int nv = int(this->rebal.maps.size());
+  if (nv == 0) {
+    return;
+  }
 
-    // fill bins into pctx->sctx->dest_bins
-    int ret = gaussian_buckets(mu, sigma, pctx->sctx.dest_bins, pctx->comm_sz);
-    // int ret = get_buckets(all_px, all_px2, all_py, all_py2, all_pz, all_pz2,
-        // pctx->sctx.dest_bins, all_num, pctx->comm_sz);
+  std::vector<unsigned long long> mine(nv);
+  for (int v = 0; v < SHUFFLE_MAX_MAP_VERSIONS; v++) {
+    const unsigned long long n = __sync_fetch_and_and(&sctx->nrecv_ver[v], 0);
+    if (v < nv) mine[v] = n;
+  }
+  std::vector<unsigned long long> all(pctx->my_rank == 0 ? nv * pctx->comm_sz
+                                                         : 0);
+  MPI_Gather(&mine[0], nv, MPI_UNSIGNED_LONG_LONG,
+             all.empty() ? NULL : &all[0], nv, MPI_UNSIGNED_LONG_LONG, 0,
+             MPI_COMM_WORLD);
+  if (pctx->my_rank != 0) {
+    return;
+  }
 
-    if (pctx->my_rank == 0) {
-      printf("--> bucket distrib: ");
-      for(int gidx = 0; gidx <= pctx->comm_sz; gidx++) {
-        printf("%lf ", pctx->sctx.dest_bins[gidx]);
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/PIVOTS-%07d.txt", pctx->log_home, epoch);
+  FILE *f = fopen(path, "w");
+  if (f == NULL) {
+    loge("fopen", path);
+    return;
+  }
+  fprintf(f, "num_versions=%d\n", nv);
+  fprintf(f, "num_bins=%d\n", pctx->comm_sz);
+  fprintf(f, "receivers=");
+  for (int b = 0; b < pctx->comm_sz; b++) {
+    fprintf(f, "%s%d", b ? " " : "", shuffle_receiver(sctx, b));
+  }
+  fputc('\n', f);
+  for (int v = 0; v < nv; v++) {
+    fprintf(f, "v%d=", v);
+    for (int b = 0; b <= pctx->comm_sz; b++) {
+      fprintf(f, "%s%.17g", b ? " " : "", this->rebal.maps[v][b]);
+    }
+    fputc('\n', f);
+  }
+  for (int r = 0; r < pctx->comm_sz; r++) {
+    bool any = false;
+    for (int v = 0; v < nv; v++) {
+      if (all[r * nv + v] != 0) {
+        fprintf(f, "%sv%d:%llu", any ? " " : "", v, all[r * nv + v]);
+        any = true;
       }
-      printf("\n");
     }
+    if (any) fprintf(f, " (r%d)\n", r);
+  }
+  fclose(f);
+}
 
-    printf("---> Ret: %d\n", ret);
-
-    assert(ret == 0);
-    // if (ret == 0) {
-      pctx->sctx.has_bins = true;
-    // }
-
-    // flush map
-    int flush_count = 0;
-    for (auto it = pctx->sctx.temp_buffer.begin(); it != pctx->sctx.temp_buffer.end(); it++) {
-      std::string fname = it->first;
-      std::string fdata = it->second;
-      // printf("--> processing %s %s at %d\n", it->first.c_str(), it->second.c_str(), pctx->my_rank);
-      int name_len = fname.length();
-      int data_len = fdata.length();
-      // assume same epoch
-      char fdata_str[255];
-      strncpy(fdata_str, fdata.c_str(), data_len);
-      rv &= shuffle_write(&pctx->sctx, fname.c_str(), name_len, fdata_str, data_len, epoch);
-      flush_count++;
-    }
+/*
+ * install_pivots: start routing particles by the negotiated bins and
+ * replay the writes staged in the meantime.
+ */
+int shuffler_udf ::install_pivots() {
+  pctx->sctx.has_bins = true;
+  if (pctx->sctx.map_versioned) {
+    rebalance_reset(&this->rebal, pctx->sctx.dest_bins,
+                    this->samples.empty() ? NULL : &this->samples[0],
+                    this->samples.size());
+    pctx->sctx.map_version = 0;
+  }
+
+  // replay staged writes in order
+  size_t flush_count = 0;
+  int rv = buffer_flush(&pctx->sctx, &flush_count);
 
-    printf("--> rank %d, epoch: %d, flush_count: %d\n", pctx->my_rank, epoch, flush_count);
+  if (pctx->my_rank == 0) {
+    logf(LOG_INFO, "energy pivots installed, %zu staged writes replayed",
+         flush_count);
+  }
 
-    pctx->sctx.temp_buffer.clear();
+  return rv;
+}
 
+inline void shuffler_udf ::tap_particle(const char* fname, const char* data,
+                                       int epoch, double energy) {
+  const float time =
+      (this->time_field >= 0)
+          ? float(pschema_get(&pctx->pschema, this->time_field, data))
+          : 0;
+  energy_tap_add(fname, epoch, time, energy);
+}
+
+/*
+ * process_batch: process n particles with fixed-size ids and data laid out
+ * back to back in ids and data.
+ *
+ * particles are taken a group at a time. energies for the whole group are
+ * computed in one vectorized pass. once bins are negotiated, the running
+ * sums are updated in that same pass and all destinations are looked up
+ * at once. before that, particles go through process_one() one by one so
+ * that bins are negotiated after exactly the same particle as process().
+ */
+int shuffler_udf ::process_batch(const char* ids, unsigned char id_len, const char* data, unsigned int data_len, size_t n, int epoch) {
+  const size_t group = 64;
+  double energies[group];
+  int targets[group];
+  int bins[group];
+  double sums[2];
+  char fname[256];
+  std::string fdata(data_len, 0);
+  shuffle_ctx_t* const sctx = &pctx->sctx;
+  const int needs_bins = shuffle_needs_bins(sctx);
+  int rv = 0;
+
+  pthread_mtx_lock(&this->mtx);
+  for (size_t i = 0; i < n && rv == 0; i += group) {
+    const size_t k = (n - i < group) ? n - i : group;
+    const char* const d = data + i * data_len;
+    const char* const id = ids + i * id_len;
+    size_t j = 0;
+
+    if (needs_bins) {
+      sums[0] = sums[1] = 0;
+      compute_energy_batch(d, data_len, k, energies,
+                           sctx->has_bins ? sums : NULL);
+      for (; j < k && !sctx->has_bins && rv == 0; j++) {
+        this->running_total += energies[j];
+        this->running_square += energies[j] * energies[j];
+        memcpy(fname, id + j * id_len, id_len);
+        fname[id_len] = 0;
+        memcpy(&fdata[0], d + j * data_len, data_len);
+        rv = process_one(fname, id_len, &fdata[0], data_len, epoch,
+                         energies[j]);
+      }
+      if (j != 0) { /* bins became available in the middle of the group */
+        for (size_t x = j; x < k; x++) {
+          sums[0] += energies[x];
+          sums[1] += energies[x] * energies[x];
+        }
+      }
+      this->running_total += sums[0];
+      this->running_square += sums[1];
+      if (j < k) {
+        shuffle_energy_targets(sctx, energies + j, targets + j, k - j,
+                               bins + j);
+        if (sctx->map_versioned) {
+          for (size_t x = j; x < k; x++) {
+            rebalance_count(&this->rebal, bins[x], energies[x]);
+          }
+        }
+      }
+    } else if (this->tap_energy) {
+      compute_energy_batch(d, data_len, k, energies, NULL);
+    }
+
+    this->running_num += k - j;
+    if (this->checking_drift) {
+      if (this->pivots.state == PIVOT_IDLE) {
+        this->samples.insert(this->samples.end(), energies + j, energies + k);
+      }
+      poll_drift();
+    }
+    for (; j < k && rv == 0; j++) {
+      memcpy(fname, id + j * id_len, id_len);
+      fname[id_len] = 0;
+      memcpy(&fdata[0], d + j * data_len, data_len);
+      if (needs_bins) {
+        rv = shuffle_write_to(sctx, fname, id_len, &fdata[0], data_len, epoch,
+                              targets[j]);
+      } else {
+        rv = shuffle_write(sctx, fname, id_len, &fdata[0], data_len, epoch);
+      }
+      if (this->tap) {
+        tap_particle(fname, &fdata[0], epoch,
+                     (needs_bins || this->tap_energy) ? energies[j] : 0.0);
+      }
+    }
+    /* only after the group has been written with the current map */
+    if (sctx->map_versioned && sctx->has_bins) {
+      poll_rebalance();
+    }
   }
 
+  pthread_mtx_unlock(&this->mtx);
+
   return rv;
 }
 
@@ -232,12 +508,28 @@ void shuffler_udf ::finalize() {
     logf(LOG_INFO, "flushing done %s",
         pretty_dura(flush_end - flush_start).c_str());
   }
+  report_imbalance();
+  if (pctx->sctx.map_versioned) {
+    dump_pivots(this->cur_epoch);
+  }
   /*
    * ensures everyone has the flushing done before finalizing so we can get
    * up-to-date and consistent shuffle stats
    */
   PRELOAD_Barrier(MPI_COMM_WORLD);
+  if (this->tap) {
+    unsigned long long n = energy_tap_close();
+    if (pctx->my_rank == 0) {
+      logf(LOG_INFO, "%s particle energies tapped (rank 0)",
+           pretty_num(n).c_str());
+    }
+    this->tap = false;
+  }
   shuffle_finalize(&pctx->sctx);
+  pivot_destroy(&this->pivots);
+  if (pctx->sctx.map_versioned) {
+    rebalance_destroy(&this->rebal);
+  }
   if (pctx->my_rank == 0) {
     logf(LOG_INFO, "shuffle off");
   }
@@ -245,7 +537,27 @@ void shuffler_udf ::finalize() {
 }
 
 int shuffler_udf ::epoch_end() {
-  fclose(this->dump_file);
+  int rv = 0;
+
+  /* ranks that staged too few particles join the negotiation now */
+  if (shuffle_needs_bins(&pctx->sctx) && !pctx->sctx.has_bins) {
+    if (this->pivots.state == PIVOT_IDLE) {
+      start_pivots();
+    }
+    pivot_wait(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz);
+    rv = install_pivots();
+  } else if (this->checking_drift) {
+    if (this->pivots.state == PIVOT_IDLE) {
+      pivot_drift_start(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz,
+                        this->samples.empty() ? NULL : &this->samples[0],
+                        this->samples.size());
+    }
+    pivot_wait(&this->pivots, pctx->sctx.dest_bins, pctx->comm_sz);
+    finish_drift();
+  }
+  if (shuffle_needs_bins(&pctx->sctx) && pctx->sctx.map_versioned) {
+    finish_rebalance();
+  }
 
   printf("Running numbers: total: %lf, square: %lf, num: %ld\n",
       this->running_total, this->running_square, this->running_num);
@@ -264,7 +576,7 @@ int shuffler_udf ::epoch_end() {
         pretty_dura(flush_end - flush_start).c_str());
   }
 
-  return 0;
+  return rv;
 }
 
 int shuffler_udf ::epoch_pre_start() {
@@ -286,16 +598,12 @@ int shuffler_udf ::epoch_pre_start() {
 }
 
 int shuffler_udf ::epoch_start(int num_eps) {
-  char final_path[256];
-  const char *home_dir = "/users/ankushj";
-  snprintf(final_path, 256, "%s/%s/%s.%d.%d", home_dir, "all_dumps", "dump", this->pctx->my_rank, num_eps);
-  printf("Dumping particle data to: %s\n", final_path);
-  this->dump_file = fopen(final_path, "w+");
-  assert(this->dump_file);
-
   this->running_total = 0;
   this->running_square = 0;
   this->running_num = 0;
+  this->samples.clear();
+  this->pivots.state = PIVOT_IDLE;
+  this->epoch_begin = now_micros();
 
   // this->running_px = 0;
   // this->running_px2 = 0;
@@ -306,7 +614,12 @@ int shuffler_udf ::epoch_start(int num_eps) {
   // this->running_pz = 0;
   // this->running_pz2 = 0;
 
-  pctx->sctx.has_bins = false;
+  /* keep the previous epoch's bins unless they were found to drift */
+  const bool warm = pctx->sctx.has_bins && !this->repivot &&
+                    pctx->sctx.pivot_drift > 0;
+  pctx->sctx.has_bins = warm;
+  this->checking_drift = warm;
+  this->repivot = false;
 
   uint64_t flush_start;
   uint64_t flush_end;
@@ -322,6 +635,54 @@ int shuffler_udf ::epoch_start(int num_eps) {
       logf(LOG_INFO, "receiver flushing done %s",
           pretty_dura(flush_end - flush_start).c_str());
     }
+    report_imbalance();
+    if (pctx->sctx.map_versioned) {
+      dump_pivots(num_eps - 1);
+    }
+  }
+  if (warm && pctx->sctx.map_versioned) {
+    rebalance_reset(&this->rebal, pctx->sctx.dest_bins, NULL, 0);
+    pctx->sctx.map_version = 0;
   }
+  this->cur_epoch = num_eps;
   return 0;
 }
+
+/*
+ * report_imbalance: log how evenly the particles of the previous epoch
+ * were spread across receivers. collective. must be called after
+ * receivers have been flushed.
+ */
+void shuffler_udf ::report_imbalance() {
+  shuffle_ctx_t *const sctx = &pctx->sctx;
+  unsigned long long sum[2], max, min;
+  unsigned long long n = __sync_fetch_and_and(&sctx->nrecv, 0);
+
+  sum[0] = sctx->is_receiver ? n : 0;
+  sum[1] = sctx->is_receiver ? 1 : 0;
+  max = sctx->is_receiver ? n : 0;
+  min = sctx->is_receiver ? n : ~0ull;
+  if (pctx->my_rank == 0) {
+    MPI_Reduce(MPI_IN_PLACE, sum, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, &max, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(MPI_IN_PLACE, &min, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, 0,
+               MPI_COMM_WORLD);
+  } else {
+    MPI_Reduce(sum, NULL, 2, MPI_UNSIGNED_LONG_LONG, MPI_SUM, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&max, NULL, 1, MPI_UNSIGNED_LONG_LONG, MPI_MAX, 0,
+               MPI_COMM_WORLD);
+    MPI_Reduce(&min, NULL, 1, MPI_UNSIGNED_LONG_LONG, MPI_MIN, 0,
+               MPI_COMM_WORLD);
+  }
+
+  if (pctx->my_rank == 0 && sum[1] != 0 && sum[0] != 0) {
+    const double avg = double(sum[0]) / sum[1];
+    logf(LOG_INFO,
+         "particles per receiver: avg %.1f, min %s, max %s "
+         "(max/avg imbalance: %.3f)",
+         avg, pretty_num(min).c_str(), pretty_num(max).c_str(), max / avg);
+  }
+}
@@ -5,12 +5,18 @@
 #pragma once
 
 #include <cassert>
+#include <vector>
 #include "udf_interface.h"
 #include "preload_internal.h"
+#include "loadbalance_util.h"
 
 class shuffler_udf : udf_interface {
   private:
     preload_ctx_t *pctx;
+    // serializes process() and process_batch(), which may be called by
+    // several dump threads at once. held across staging, pivot
+    // negotiation, and rebalancing, which all run on the calling thread
+    pthread_mutex_t mtx;
     double running_total;
     double running_square;
 
@@ -25,12 +31,42 @@ class shuffler_udf : udf_interface {
 
     long int running_num;
 
-    FILE *dump_file;
+    // energies seen before the bins are negotiated
+    std::vector<double> samples;
+    pivot_negotiation pivots;
+    uint64_t epoch_begin; // micros
+    // bins are reused from the previous epoch and being checked for drift
+    bool checking_drift;
+    // the last drift check asked for new bins in the next epoch
+    bool repivot;
+    // refines bins within an epoch (SHUFFLE_Rebalance_ms)
+    rebalancer rebal;
+    int cur_epoch;
+
+    // SHUFFLE_Energy_tap_dir
+    bool tap;
+    bool tap_energy; // compute energies for the tap alone
+    int time_field;  // schema index of the particle time, or -1
+
+    bool pivots_due();
+    void start_pivots();
+    int install_pivots();
+    void poll_drift();
+    void finish_drift();
+    void poll_rebalance();
+    void finish_rebalance();
+    void dump_pivots(int epoch);
+    void open_tap();
+    void tap_particle(const char* fname, const char* data, int epoch,
+                      double energy);
+    void report_imbalance();
+    int process_one(const char* fname, unsigned char fname_len, char* data, unsigned int data_len, int epoch, double energy);
   public:
     shuffler_udf();
     ~shuffler_udf();
     void init(preload_ctx_t *pctx_arg);
-    int process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch);
+    int process(const char* fname, unsigned char fname_len, char* data, unsigned int data_len, int epoch);
+    int process_batch(const char* ids, unsigned char id_len, const char* data, unsigned int data_len, size_t n, int epoch);
     int epoch_start(int num_eps);
     int epoch_end();
     int epoch_pre_start();
@@ -9,7 +9,8 @@
 class udf_interface {
   public:
     virtual void init(preload_ctx_t *pctx_arg) = 0;
-    virtual int process(const char* fname, unsigned char fname_len, char* data, unsigned char data_len, int epoch) = 0;
+    virtual int process(const char* fname, unsigned char fname_len, char* data, unsigned int data_len, int epoch) = 0;
+    virtual int process_batch(const char* ids, unsigned char id_len, const char* data, unsigned int data_len, size_t n, int epoch) = 0;
     virtual int epoch_start(int num_eps) = 0;
     virtual int epoch_end() = 0;
     virtual int epoch_pre_start() = 0;
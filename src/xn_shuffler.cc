@@ -110,7 +110,7 @@ static void xn_shuffler_deliver(int src, int dst, uint32_t type, void* buf,
   }
 }
 
-void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned char buf_sz,
+void xn_shuffler_enqueue(xn_ctx_t* ctx, void* buf, unsigned int buf_sz,
                          int epoch, int dst, int src) {
   hg_return_t hret;
   assert(ctx->sh != NULL);
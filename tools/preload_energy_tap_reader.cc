@@ -0,0 +1,207 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload_energy_tap_reader.cc
+ *
+ * print binary energy taps (SHUFFLE_Energy_tap_dir) as text, one particle
+ * per line: rank, epoch, time, energy, and id.
+ */
+
+#include <ctype.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "energy_tap.h"
+
+static char* argv0; /* argv[0], program name */
+static struct gs {
+  int csv;     /* print comma separated values */
+  int hex;     /* print particle ids in hex */
+  int epoch;   /* only print this epoch if not -1 */
+  int summary; /* only print per-epoch counts and energy ranges */
+} g;
+
+/*
+ * complain about something and exit.
+ */
+static void complain(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "!!! ERROR !!! %s: ", argv0);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+/*
+ * usage
+ */
+static void usage(const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options] tap-file ...\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-C        print comma separated values\n");
+  fprintf(stderr, "\t-x        print particle ids in hex\n");
+  fprintf(stderr, "\t-e epoch  only print particles of the given epoch\n");
+  fprintf(stderr, "\t-c        only print per-epoch counts and energy ranges\n");
+  exit(1);
+}
+
+struct epoch_summary {
+  unsigned long long n;
+  double min;
+  double max;
+  double sum;
+};
+
+static void print_id(const char* id, unsigned id_sz) {
+  bool printable = !g.hex;
+  for (unsigned i = 0; i < id_sz && printable; i++) {
+    if (id[i] != 0 && !isprint(static_cast<unsigned char>(id[i]))) {
+      printable = false;
+    }
+  }
+  if (printable) {
+    printf("%.*s", int(strnlen(id, id_sz)), id);
+  } else {
+    for (unsigned i = 0; i < id_sz; i++) {
+      printf("%02x", static_cast<unsigned char>(id[i]));
+    }
+  }
+}
+
+static void decode(const char* path) {
+  std::vector<epoch_summary> epochs;
+  std::vector<char> rec;
+  etap_hdr_t hdr;
+  FILE* f;
+
+  f = fopen(path, "r");
+  if (f == NULL) complain("error opening %s: %s", path, strerror(errno));
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, ETAP_MAGIC, 8) != 0) {
+    complain("%s: not an energy tap", path);
+  }
+  if (hdr.rec_sz != ETAP_REC_FIXED + hdr.id_sz) {
+    complain("%s: unexpected record size %u", path, hdr.rec_sz);
+  }
+
+  rec.resize(hdr.rec_sz);
+  while (fread(&rec[0], hdr.rec_sz, 1, f) == 1) {
+    int32_t epoch;
+    float time;
+    double energy;
+    memcpy(&epoch, &rec[0], 4);
+    memcpy(&time, &rec[4], 4);
+    memcpy(&energy, &rec[8], 8);
+    if (g.epoch != -1 && epoch != g.epoch) continue;
+    if (g.summary) {
+      if (epoch < 0) continue;
+      if (size_t(epoch) >= epochs.size()) {
+        epoch_summary e = {0, 0, 0, 0};
+        epochs.resize(epoch + 1, e);
+      }
+      epoch_summary* const e = &epochs[epoch];
+      if (e->n == 0 || energy < e->min) e->min = energy;
+      if (e->n == 0 || energy > e->max) e->max = energy;
+      e->sum += energy;
+      e->n++;
+      continue;
+    }
+    const char* const sep = g.csv ? "," : " ";
+    printf("%u%s%d%s%.9g%s%.17g%s", hdr.rank, sep, epoch, sep, time, sep,
+           energy, sep);
+    print_id(&rec[ETAP_REC_FIXED], hdr.id_sz);
+    putchar('\n');
+  }
+  if (ferror(f)) complain("error reading %s: %s", path, strerror(errno));
+  fclose(f);
+
+  if (g.summary) {
+    printf("== %s (rank %u)\n", path, hdr.rank);
+    for (size_t i = 0; i < epochs.size(); i++) {
+      const epoch_summary* const e = &epochs[i];
+      if (e->n != 0) {
+        printf("epoch %-4d %12llu particles, energy %g..%g (avg %g)\n",
+               int(i), e->n, e->min, e->max, e->sum / e->n);
+      }
+    }
+  }
+}
+
+/*
+ * main program
+ */
+int main(int argc, char* argv[]) {
+  int ch;
+
+  argv0 = argv[0];
+  memset(&g, 0, sizeof(g));
+  g.epoch = -1;
+  while ((ch = getopt(argc, argv, "Cxe:c")) != -1) {
+    switch (ch) {
+      case 'C':
+        g.csv = 1;
+        break;
+      case 'x':
+        g.hex = 1;
+        break;
+      case 'e':
+        g.epoch = atoi(optarg);
+        if (g.epoch < 0) usage("bad epoch");
+        break;
+      case 'c':
+        g.summary = 1;
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc < 1) usage("no tap files");
+
+  if (g.csv && !g.summary) {
+    printf("rank,epoch,time,energy,id\n");
+  }
+  for (int i = 0; i < argc; i++) {
+    decode(argv[i]);
+  }
+
+  return 0;
+}
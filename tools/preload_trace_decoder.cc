@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2019, Carnegie Mellon University.
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * ``AS IS'' AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDERS OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY
+ * WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * preload_trace_decoder.cc
+ *
+ * print binary testing traces (PRELOAD_Trace_binary) as text, in the same
+ * format as the text traces of the preload library.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+#include "bin_trace.h"
+
+static char* argv0; /* argv[0], program name */
+static struct gs {
+  int sort;    /* sort records by time */
+  int summary; /* only print per-type counts */
+} g;
+
+/*
+ * complain about something and exit.
+ */
+static void complain(const char* format, ...) {
+  va_list ap;
+  va_start(ap, format);
+  fprintf(stderr, "!!! ERROR !!! %s: ", argv0);
+  vfprintf(stderr, format, ap);
+  fprintf(stderr, "\n");
+  va_end(ap);
+  exit(1);
+}
+
+/*
+ * usage
+ */
+static void usage(const char* msg) {
+  if (msg) fprintf(stderr, "%s: %s\n", argv0, msg);
+  fprintf(stderr, "usage: %s [options] trace-file ...\n", argv0);
+  fprintf(stderr, "\noptions:\n");
+  fprintf(stderr, "\t-s        sort records of each file by time\n");
+  fprintf(stderr, "\t-c        only print the num of records of each type\n");
+  exit(1);
+}
+
+static bool by_time(const trace_rec_t& a, const trace_rec_t& b) {
+  return a.micros < b.micros;
+}
+
+static const char* type_name(int type) {
+  static const char* const names[] = {
+      "?",          "SH",        "LO",         "RM",
+      "SEND",       "RECV",      "DELIV-WAIT", "SEND-SLOT",
+      "REPLY-WAIT", "ENQUEUE-WAIT", "DROPS"};
+  if (type < 0 || type > TRACE_DROPS) return "?";
+  return names[type];
+}
+
+/*
+ * print_rec: print a record the way the preload library prints text traces
+ */
+static void print_rec(const trace_rec_t* r) {
+  printf("%10llu.%06llu t%-3u ", (unsigned long long)(r->micros / 1000000),
+         (unsigned long long)(r->micros % 1000000), unsigned(r->tid));
+  switch (r->type) {
+    case TRACE_SH:
+      printf("[SH] %u bytes (ep=%d) r%d >> r%d (xx=%08x)\n", r->size, r->epoch,
+             r->src, r->dst, r->hash);
+      break;
+    case TRACE_LO:
+      printf("[LO] %u bytes (ep=%d) (xx=%08x)\n", r->size, r->epoch, r->hash);
+      break;
+    case TRACE_RM:
+      printf("[RM] %u bytes (ep=%d) r%d << r%d (xx=%08x)\n", r->size, r->epoch,
+             r->dst, r->src, r->hash);
+      break;
+    case TRACE_SEND:
+      printf("[SEND] %u bytes r%d >> r%d\n", r->size, r->src, r->dst);
+      break;
+    case TRACE_RECV:
+      printf("[RECV] %u bytes r%d << r%d\n", r->size, r->dst, r->src);
+      break;
+    case TRACE_REPLY_WAIT:
+      if (r->src != -1) {
+        printf("[REPLY-WAIT] r%d >> r%d %u us\n", r->src, r->dst, r->size);
+        break;
+      }
+      /* fall through */
+    case TRACE_DELIV_WAIT:
+    case TRACE_SEND_SLOT:
+    case TRACE_ENQUEUE_WAIT:
+      printf("[%s] %u us\n", type_name(r->type), r->size);
+      break;
+    case TRACE_DROPS:
+      printf("[DROPS] %u events\n", r->size);
+      break;
+    default:
+      printf("[?] type %u\n", unsigned(r->type));
+      break;
+  }
+}
+
+static void decode(const char* path) {
+  std::vector<trace_rec_t> recs;
+  unsigned long long counts[TRACE_DROPS + 1];
+  trace_hdr_t hdr;
+  trace_rec_t rec;
+  FILE* f;
+
+  f = fopen(path, "r");
+  if (f == NULL) complain("error opening %s: %s", path, strerror(errno));
+  if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+      memcmp(hdr.magic, TRACE_MAGIC, 8) != 0) {
+    complain("%s: not a binary trace", path);
+  }
+  if (hdr.rec_sz != sizeof(trace_rec_t)) {
+    complain("%s: unexpected record size %u", path, hdr.rec_sz);
+  }
+
+  memset(counts, 0, sizeof(counts));
+  printf("== %s (rank %u)\n", path, hdr.rank);
+  while (fread(&rec, sizeof(rec), 1, f) == 1) {
+    if (rec.type <= TRACE_DROPS) counts[rec.type]++;
+    if (g.summary) continue;
+    if (g.sort) {
+      recs.push_back(rec);
+    } else {
+      print_rec(&rec);
+    }
+  }
+  if (ferror(f)) complain("error reading %s: %s", path, strerror(errno));
+  fclose(f);
+
+  if (g.sort) {
+    std::stable_sort(recs.begin(), recs.end(), by_time);
+    for (size_t i = 0; i < recs.size(); i++) {
+      print_rec(&recs[i]);
+    }
+  }
+  if (g.summary) {
+    for (int i = 1; i <= TRACE_DROPS; i++) {
+      if (counts[i] != 0) {
+        printf("%-14s %llu\n", type_name(i), counts[i]);
+      }
+    }
+  }
+}
+
+/*
+ * main program
+ */
+int main(int argc, char* argv[]) {
+  int ch;
+
+  argv0 = argv[0];
+  memset(&g, 0, sizeof(g));
+  while ((ch = getopt(argc, argv, "sc")) != -1) {
+    switch (ch) {
+      case 's':
+        g.sort = 1;
+        break;
+      case 'c':
+        g.summary = 1;
+        break;
+      default:
+        usage(NULL);
+    }
+  }
+  argc -= optind;
+  argv += optind;
+  if (argc < 1) usage("no trace files");
+
+  for (int i = 0; i < argc; i++) {
+    decode(argv[i]);
+  }
+
+  return 0;
+}